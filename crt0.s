@@ -2,6 +2,8 @@
         .module crt0
        	.globl	_main
         .globl  _sr
+        .globl  _uart_isr
+        .globl  _nmi_entry
 
 	.area	_HEADER (ABS)
 	;; Reset vector
@@ -39,15 +41,15 @@
         jp      _sr
 	
         .org    0x38
-        jp      0x0b038
+        jp      _uart_isr        ;; UART RX when built with UART_RX_IRQ,
+                                 ;; else straight on to the handler at 0xb038
 	
 ;;;  NMI will be used for the 'bash' button
 ;;;  If the user bashes this button, control will be given back to the
-;;;  monitor in order to resync with the debugger
+;;;  monitor in order to resync with the debugger.  nmi_entry holds it
+;;;  back while the monitor itself is running.
 	.org    0x66
-        push    hl
-        ld      hl,#0x66
-        jp      _sr
+        jp      _nmi_entry
 
 
 	.org	0x100
@@ -56,6 +58,15 @@ init:
 ;;; 	ld	sp, #0xb000
 	ld	sp, #0xb000
 
+        ;; Clear the stub's variables, RAM comes up with garbage and
+        ;; the breakpoint, watchpoint and trace tables count on zeros
+        ld      hl, #s__DATA
+        ld      bc, #l__DATA
+        call    zero
+        ld      hl, #s__BSS
+        ld      bc, #l__BSS
+        call    zero
+
         ;; Initialise global variables
         call    gsinit
 	call	_main
@@ -77,6 +88,22 @@ __clock::
         rst     0x08
 	ret
 
+;; Zero bc bytes at hl
+zero:
+        ld      a, b
+        or      c
+        ret     z
+        ld      (hl), #0
+        dec     bc
+        ld      a, b
+        or      c
+        ret     z
+        ld      e, l
+        ld      d, h
+        inc     de
+        ldir
+        ret
+
 _exit::
 	;; Exit - special code to the emulator
 	ld	a,#0
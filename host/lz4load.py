@@ -0,0 +1,304 @@
+#!/usr/bin/env python3
+"""lz4load -- download an image to the stub as LZ4 compressed blocks
+
+Reads an Intel hex (monitor.hex style) or ELF file and sends each
+segment with vLZWrite packets: an LZ4 block the stub unpacks in place
+and checks against the length and CRC-32 in the packet.  Blocks that
+do not compress go as X packets, and so does everything if the stub
+does not know vLZWrite (an empty reply).  TARGET is HOST:PORT, e.g.
+:2000 for host/z80sim, or a serial device.
+
+With -d only the blocks whose CRC-32 on the target (qCRCBlocks)
+differs from the image are sent, so a reload after a small change
+moves little more than the change.
+
+Load before gdb connects, or in place of gdb's load: the stub must be
+stopped and waiting for packets.
+"""
+
+import argparse
+import struct
+import sys
+import time
+
+from rsp import Remote, open_target
+
+# LZ4 block format limits
+MIN_MATCH = 4
+MAX_OFFSET = 0xFFFF
+MF_LIMIT = 12           # no match starts in the last 12 bytes
+LAST_LITERALS = 5       # and the last 5 are always literals
+
+# the stub unpacks a block in place, all below BANKED_BASE or in one
+# bank: BANKED_MEMORY's defaults in z80-stub.c
+BANKED_BASE = 0x10000
+BANK_SIZE = 0x4000
+
+
+def lz4_length(out, n):
+    """The bytes after a 15 nibble: 255s, then the rest."""
+    n -= 15
+    while n >= 255:
+        out.append(255)
+        n -= 255
+    out.append(n)
+
+
+def lz4_sequence(out, literals, offset=0, match=0):
+    lit = len(literals)
+    ml = match - MIN_MATCH
+    out.append((min(lit, 15) << 4) | (min(ml, 15) if match else 0))
+    if lit >= 15:
+        lz4_length(out, lit)
+    out += literals
+    if match:
+        out += struct.pack("<H", offset)
+        if ml >= 15:
+            lz4_length(out, ml)
+
+
+def lz4_compress(data):
+    """A greedy LZ4 block compressor, the last match found for each 4
+    byte string."""
+    n = len(data)
+    out = bytearray()
+    table = {}
+    anchor = i = 0
+    while i < n - MF_LIMIT:
+        key = data[i:i + MIN_MATCH]
+        ref = table.get(key)
+        table[key] = i
+        if ref is None or i - ref > MAX_OFFSET:
+            i += 1
+            continue
+        m = MIN_MATCH
+        while i + m < n - LAST_LITERALS and data[ref + m] == data[i + m]:
+            m += 1
+        lz4_sequence(out, data[anchor:i], i - ref, m)
+        for j in range(i + 1, min(i + m, n - MF_LIMIT)):
+            table[data[j:j + MIN_MATCH]] = j
+        i += m
+        anchor = i
+    lz4_sequence(out, data[anchor:])
+    return bytes(out)
+
+
+def crc_table():
+    table = []
+    for i in range(256):
+        crc = i << 24
+        for _ in range(8):
+            if crc & 0x80000000:
+                crc = ((crc << 1) ^ 0x04C11DB7) & 0xFFFFFFFF
+            else:
+                crc = (crc << 1) & 0xFFFFFFFF
+        table.append(crc)
+    return table
+
+
+CRC_TABLE = crc_table()
+
+
+def crc32(data):
+    """CRC-32 as gdb's qCRC: msb first, from 0xffffffff, not inverted."""
+    crc = 0xFFFFFFFF
+    for b in data:
+        crc = ((crc << 8) & 0xFFFFFFFF) ^ CRC_TABLE[(crc >> 24) ^ b]
+    return crc
+
+
+def read_ihx(path):
+    """Data records of an Intel hex file, as (address, bytes) runs."""
+    segments = []
+    base = 0
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if not line.startswith(":"):
+                continue
+            rec = bytes.fromhex(line[1:])
+            if sum(rec) & 0xFF:
+                raise ValueError("%s: bad checksum: %s" % (path, line))
+            count, addr, kind = rec[0], (rec[1] << 8) | rec[2], rec[3]
+            data = rec[4:4 + count]
+            if kind == 0:
+                addr += base
+                if segments and segments[-1][0] + len(segments[-1][1]) == addr:
+                    segments[-1][1].extend(data)
+                else:
+                    segments.append((addr, bytearray(data)))
+            elif kind == 1:
+                break
+            elif kind == 2:
+                base = struct.unpack(">H", data)[0] << 4
+            elif kind == 4:
+                base = struct.unpack(">H", data)[0] << 16
+    return [(addr, bytes(data)) for addr, data in segments]
+
+
+def read_elf(path):
+    """PT_LOAD segments of a little endian ELF32 file, at their
+    physical addresses."""
+    with open(path, "rb") as f:
+        image = f.read()
+    if image[4] != 1 or image[5] != 1:
+        raise ValueError("%s: not a little endian ELF32 file" % path)
+    phoff, = struct.unpack_from("<I", image, 28)
+    phentsize, phnum = struct.unpack_from("<HH", image, 42)
+    segments = []
+    for i in range(phnum):
+        (kind, offset, _, paddr, filesz, _, _, _) = struct.unpack_from(
+            "<8I", image, phoff + i * phentsize)
+        if kind == 1 and filesz:
+            segments.append((paddr, image[offset:offset + filesz]))
+    return segments
+
+
+def read_image(path):
+    with open(path, "rb") as f:
+        elf = f.read(4) == b"\x7fELF"
+    return read_elf(path) if elf else read_ihx(path)
+
+
+class Loader:
+    def __init__(self, remote, size, lz):
+        self.remote = remote
+        self.room = size - 1    # the stub keeps a byte of its buffer
+        self.lz = lz
+        self.lz_bytes = 0
+        self.x_bytes = 0
+
+    def send(self, payload, what):
+        reply = self.remote.command(payload)
+        if reply != b"OK":
+            raise RuntimeError("%s: %r" % (what, reply))
+
+    def lz_packet(self, addr, data):
+        """The largest vLZWrite packet that fits from the front of data,
+        and the bytes it covers.  None if it does not pay."""
+        n = min(len(data), 4 * self.room)
+        if addr < BANKED_BASE:
+            n = min(n, BANKED_BASE - addr)
+        else:
+            n = min(n, BANK_SIZE - (addr - BANKED_BASE) % BANK_SIZE)
+        while n:
+            raw = data[:n]
+            packet = (b"vLZWrite:%x,%x,%08x:" % (addr, n, crc32(raw))
+                      + lz4_compress(raw))
+            if len(packet) <= self.room:
+                break
+            n = min(n - 1, n * self.room // len(packet))
+        if not n or len(packet) >= n + len(b"X%x,%x:" % (addr, n)):
+            return None, 0
+        return packet, n
+
+    def changed(self, addr, data, block):
+        """The (offset, length) runs of data that differ from the target,
+        by block CRCs.  None if the stub has no qCRCBlocks."""
+        crcs = []
+        while len(crcs) * block < len(data):
+            off = len(crcs) * block
+            reply = self.remote.command(b"qCRCBlocks:%x,%x,%x"
+                                        % (addr + off, len(data) - off, block))
+            if not reply:
+                return None
+            if reply[0:1] != b"C" or len(reply) < 9 or len(reply) % 8 != 1:
+                raise RuntimeError("qCRCBlocks at %04x: %r"
+                                   % (addr + off, reply))
+            crcs += [int(reply[i:i + 8], 16) for i in range(1, len(reply), 8)]
+        runs = []
+        for i, crc in enumerate(crcs):
+            off = i * block
+            part = data[off:off + block]
+            if crc32(part) == crc:
+                continue
+            if runs and runs[-1][0] + runs[-1][1] == off:
+                runs[-1][1] += len(part)
+            else:
+                runs.append([off, len(part)])
+        return runs
+
+    def load(self, addr, data):
+        off = 0
+        while off < len(data):
+            if self.lz:
+                packet, n = self.lz_packet(addr + off, data[off:])
+                if packet:
+                    reply = self.remote.command(packet)
+                    if reply == b"OK":
+                        self.lz_bytes += n
+                        off += n
+                        continue
+                    if reply:
+                        raise RuntimeError("vLZWrite at %04x: %r"
+                                           % (addr + off, reply))
+                    self.lz = False     # an older stub
+            header = len(b"X%x,%x:" % (addr + off, self.room))
+            n = min(len(data) - off, self.room - header)
+            self.send(b"X%x,%x:" % (addr + off, n) + data[off:off + n],
+                      "X at %04x" % (addr + off))
+            self.x_bytes += n
+            off += n
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("image", help="Intel hex or ELF file")
+    parser.add_argument("target", help="HOST:PORT or a serial device")
+    parser.add_argument("-b", "--baud", type=int,
+                        help="baud rate of a serial target")
+    parser.add_argument("--noack", action="store_true",
+                        help="negotiate QStartNoAckMode first")
+    parser.add_argument("--no-lz", action="store_true",
+                        help="plain X packets, to compare")
+    parser.add_argument("-d", "--delta", action="store_true",
+                        help="only send the blocks that changed")
+    parser.add_argument("-B", "--block", type=int, default=128,
+                        help="block size for -d (default 128)")
+    args = parser.parse_args()
+
+    segments = read_image(args.image)
+    remote = Remote(open_target(args.target, args.baud))
+    # ack a stop reply the stub may still be waiting on, it skips the
+    # rest until a '$'
+    remote.write(b"+")
+
+    size = 0x100
+    for feature in remote.command(b"qSupported").split(b";"):
+        if feature.startswith(b"PacketSize="):
+            size = int(feature[len(b"PacketSize="):], 16)
+    if args.noack:
+        reply = remote.command(b"QStartNoAckMode")
+        if reply != b"OK":
+            raise RuntimeError("QStartNoAckMode: %r" % reply)
+        remote.ack = False
+
+    loader = Loader(remote, size, not args.no_lz)
+    start = time.time()
+    for addr, data in segments:
+        runs = None
+        if args.delta:
+            runs = loader.changed(addr, data, args.block)
+            if runs is None:
+                print("no qCRCBlocks in the stub, loading everything")
+                args.delta = False
+        if runs is None:
+            runs = [(0, len(data))]
+        for off, length in runs:
+            loader.load(addr + off, data[off:off + length])
+    elapsed = time.time() - start
+
+    total = sum(len(data) for _, data in segments)
+    print("%d bytes in %d segments: %d unpacked by the stub, %d as X, "
+          "%d unchanged"
+          % (total, len(segments), loader.lz_bytes, loader.x_bytes,
+             total - loader.lz_bytes - loader.x_bytes))
+    print("%d bytes sent, %.2f bytes loaded per byte on the line, %.2f s"
+          % (remote.sent, total / max(remote.sent, 1), elapsed))
+
+
+if __name__ == "__main__":
+    try:
+        main()
+    except (OSError, RuntimeError, ValueError) as e:
+        sys.exit("lz4load: %s" % e)
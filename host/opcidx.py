@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+"""opcidx -- the flat opcode index tables of z80-stub.c
+
+doSStep finds the decode entry of an opcode with one lookup in
+opc_main_idx, opc_ed_idx and opc_ind_idx instead of the scan of
+opc_main, opc_ed and opc_ind the tables were written for: the first
+entry with val == (opcode & mask).  This computes those indexes from
+the tab_elt tables in z80-stub.c.
+
+    opcidx.py z80-stub.c            print the index arrays, as C
+    opcidx.py --check z80-stub.c    check the arrays in the file give
+                                    the scan's entry for every opcode
+"""
+
+import argparse
+import re
+import sys
+
+TABLES = ["opc_main", "opc_ed", "opc_ind"]
+ENTRY = re.compile(r"\{\s*(0x[0-9A-Fa-f]+)\s*,\s*(0x[0-9A-Fa-f]+)\s*,")
+
+
+def block(source, start):
+    """The text from start to the end of the initializer after it."""
+    i = source.index(start)
+    return source[source.index("{", i) + 1:source.index("};", i)]
+
+
+def read_table(source, name):
+    entries = [(int(v, 16), int(m, 16))
+               for v, m in ENTRY.findall(block(source, name + "[] ="))]
+    if not entries or entries[-1][1] != 0:
+        raise ValueError("%s: no catch-all last entry" % name)
+    return entries
+
+
+def scan(table, opcode):
+    """The entry the linear scan of doSStep used to find."""
+    for i, (val, mask) in enumerate(table):
+        if val == opcode & mask:
+            return i
+    raise AssertionError("unreachable, the last entry matches all")
+
+
+def read_index(source, name):
+    text = re.sub(r"/\*.*?\*/", "", block(source, name + "_idx[256] ="),
+                  flags=re.S)
+    return [int(n, 0) for n in re.findall(r"0x[0-9A-Fa-f]+|\d+", text)]
+
+
+def c_array(name, index):
+    lines = ["static const unsigned char %s_idx[256] =" % name, "{"]
+    for row in range(0, 256, 16):
+        cells = ", ".join("%2d" % n for n in index[row:row + 16])
+        lines.append("  " + cells + ("," if row < 240 else ""))
+    lines.append("};")
+    return "\n".join(lines)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("source", help="z80-stub.c")
+    parser.add_argument("--check", action="store_true",
+                        help="compare with the arrays in the source")
+    args = parser.parse_args()
+
+    with open(args.source) as f:
+        source = f.read()
+
+    bad = 0
+    for name in TABLES:
+        table = read_table(source, name)
+        want = [scan(table, opcode) for opcode in range(256)]
+        if not args.check:
+            print(c_array(name, want))
+            continue
+        have = read_index(source, name)
+        if len(have) != 256:
+            print("%s_idx: %d entries" % (name, len(have)))
+            bad += 1
+            continue
+        for opcode in range(256):
+            if have[opcode] != want[opcode]:
+                print("%s_idx[0x%02x] = %d, the scan finds %d"
+                      % (name, opcode, have[opcode], want[opcode]))
+                bad += 1
+    if args.check:
+        print("%s: %d of %d opcodes differ"
+              % (args.source, bad, 256 * len(TABLES)))
+    return 1 if bad else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+"""rletest -- check the stub's run length encoding of replies, in z80sim
+
+Starts host/z80sim on monitor.hex, writes a corpus of patterns to
+scratch RAM with X and reads each back with m.  The reply must expand
+(Remote.expand) to the hex of what was written, every count after a
+'*' must be printable and none of '#', '$', '+' or '-', and the reply
+must be no longer than the encoding putpacket is meant to give.
+
+The corpus has runs of every length from 1 to 20 hex digits, around
+one (97) and two full counts, and longer ones up to what an m reply
+holds, of '0' and 'f' digits, odd lengths as well as even, plus every
+byte value and random data.  Prints a line per failure and a summary;
+the exit status is 1 if anything failed.
+"""
+
+import argparse
+import os
+import random
+import subprocess
+import sys
+
+from rsp import Remote, connect, free_port
+
+# scratch RAM above the monitor stack, as for rspbench
+SCRATCH_ADDR = 0xC000
+
+# putpacket's encoding: X*c for X and c - RLE_BIAS more copies
+RLE_BIAS = 29
+RLE_MIN_REPEAT = 3
+RLE_MAX_REPEAT = ord("~") - RLE_BIAS
+BAD_COUNTS = b"#$+-"
+
+# a byte that makes no run with itself or its neighbours
+BOUND = 0x12
+
+
+def reference(text):
+    """The reply putpacket should send for text, greedy as the stub."""
+    out = bytearray()
+    i = 0
+    while i < len(text):
+        ch = text[i]
+        out.append(ch)
+        i += 1
+        repeat = 0
+        while (repeat < RLE_MAX_REPEAT and i + repeat < len(text)
+               and text[i + repeat] == ch):
+            repeat += 1
+        while repeat + RLE_BIAS in BAD_COUNTS:
+            repeat -= 1
+        if repeat >= RLE_MIN_REPEAT:
+            out += b"*" + bytes([repeat + RLE_BIAS])
+            i += repeat
+    return bytes(out)
+
+
+def digit_run(digit, length):
+    """Bytes whose hex has a run of length copies of the hex digit."""
+    fill = bytes([digit * 0x11]) * (length // 2)
+    if length % 2:
+        fill = bytes([0x10 | digit]) + fill
+    return bytes([BOUND]) + fill + bytes([BOUND])
+
+
+def corpus(room):
+    """(name, data) pairs, none longer than room bytes."""
+    lengths = (list(range(1, 21)) + list(range(95, 102))
+               + list(range(192, 198)) + [291, 500, 1000])
+    cases = []
+    for digit in (0x0, 0xF):
+        for length in lengths:
+            cases.append(("%x*%d" % (digit, length), digit_run(digit, length)))
+    for value in range(256):
+        cases.append(("byte %02x" % value, bytes([BOUND, value, value, BOUND])))
+    cases.append(("bytes 00-ff", bytes(range(256))))
+    rng = random.Random(1)
+    cases.append(("random", bytes(rng.randrange(256) for _ in range(room))))
+    cases.append(("random runs",
+                  b"".join(bytes([rng.randrange(256)]) * rng.randrange(1, 9)
+                           for _ in range(room))[:room]))
+    return [(name, data) for name, data in cases if len(data) <= room]
+
+
+def bad_counts(raw):
+    """Complaints about the '*' counts of a raw reply."""
+    errors = []
+    i = 0
+    while i < len(raw):
+        if raw[i] != ord("*"):
+            i += 1
+            continue
+        if i == 0 or i + 1 >= len(raw):
+            errors.append("'*' without a character or count at %d" % i)
+            break
+        count = raw[i + 1]
+        if count < RLE_MIN_REPEAT + RLE_BIAS or count > ord("~"):
+            errors.append("count %r at %d" % (chr(count), i + 1))
+        elif count in BAD_COUNTS:
+            errors.append("count %r at %d" % (chr(count), i + 1))
+        i += 2
+    return errors
+
+
+def check(remote, size, data):
+    """Complaints about the reply to reading back data."""
+    room = size - 1 - len(b"X%x,%x:" % (SCRATCH_ADDR, size))
+    for off in range(0, len(data), room // 2):
+        part = data[off:off + room // 2]     # room for X escapes
+        reply = remote.command(b"X%x,%x:" % (SCRATCH_ADDR + off, len(part))
+                               + part)
+        if reply != b"OK":
+            return ["X: %r" % reply]
+    reply = remote.command(b"m%x,%x" % (SCRATCH_ADDR, len(data)))
+    want = data.hex().encode()
+    if reply != want:
+        return ["expands to %r..., not %r..." % (reply[:40], want[:40])]
+    errors = bad_counts(remote.raw)
+    if len(remote.raw) > len(reference(want)):
+        errors.append("%d characters, %d expected"
+                      % (len(remote.raw), len(reference(want))))
+    return errors
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("hexfile", help="the stub, monitor.hex")
+    parser.add_argument("--sim", default=os.path.join(here, "z80sim"),
+                        help="the emulator (default host/z80sim)")
+    args = parser.parse_args()
+
+    port = free_port()
+    sim = subprocess.Popen([args.sim, "-t", str(port), args.hexfile],
+                           stdout=subprocess.DEVNULL,
+                           stderr=subprocess.DEVNULL)
+    try:
+        remote = Remote(connect("127.0.0.1", port))
+        # the stub is still waiting for an ack of its first stop reply
+        remote.write(b"+")
+        size = 0x100
+        for feature in remote.command(b"qSupported").split(b";"):
+            if feature.startswith(b"PacketSize="):
+                size = int(feature[len(b"PacketSize="):], 16)
+        # an m reply of n bytes is 2n hex digits, the stub keeps a byte
+        room = (size - 1) // 2
+
+        failed = digits = sent = 0
+        cases = corpus(room)
+        for name, data in cases:
+            errors = check(remote, size, data)
+            for error in errors:
+                print("%s: %s" % (name, error))
+            failed += bool(errors)
+            digits += 2 * len(data)
+            sent += len(remote.raw)
+    finally:
+        sim.terminate()
+        sim.wait()
+
+    print("%d cases, %d failed; %d hex digits sent as %d characters (%.2f)"
+          % (len(cases), failed, digits, sent, sent / max(digits, 1)))
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    try:
+        sys.exit(main())
+    except (OSError, RuntimeError) as e:
+        sys.exit("rletest: %s" % e)
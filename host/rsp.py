@@ -0,0 +1,132 @@
+"""rsp -- the remote protocol client side shared by the host tools"""
+
+import os
+import socket
+import termios
+import time
+
+
+class Remote:
+    """Just enough of the remote protocol, counting bytes both ways."""
+
+    def __init__(self, sock):
+        self.sock = sock
+        self.ack = True
+        self.sent = 0
+        self.received = 0
+        self.packets = 0
+        self.pending = b""
+        self.raw = b""          # the last reply as sent, before expand
+
+    def write(self, data):
+        self.sock.sendall(data)
+        self.sent += len(data)
+
+    def read_byte(self):
+        if not self.pending:
+            self.pending = self.sock.recv(4096)
+            if not self.pending:
+                raise RuntimeError("connection closed")
+            self.received += len(self.pending)
+        c = self.pending[0:1]
+        self.pending = self.pending[1:]
+        return c
+
+    def send(self, payload):
+        out = bytearray()
+        for b in payload:
+            if b in b"#$}*":
+                out += bytes([0x7D, b ^ 0x20])
+            else:
+                out.append(b)
+        frame = b"$" + bytes(out) + b"#%02x" % (sum(out) & 0xFF)
+        self.write(frame)
+        self.packets += 1
+
+    def receive(self):
+        while self.read_byte() != b"$":
+            pass
+        data = bytearray()
+        while True:
+            c = self.read_byte()
+            if c == b"#":
+                break
+            data += c
+        checksum = int(self.read_byte() + self.read_byte(), 16)
+        if checksum != sum(data) & 0xFF:
+            raise RuntimeError("bad checksum")
+        if self.ack:
+            self.write(b"+")
+        self.raw = bytes(data)
+        return self.expand(self.raw)
+
+    @staticmethod
+    def expand(data):
+        out = bytearray()
+        i = 0
+        while i < len(data):
+            if data[i] == ord("*") and out:
+                out += out[-1:] * (data[i + 1] - 29)
+                i += 2
+            else:
+                out.append(data[i])
+                i += 1
+        return bytes(out)
+
+    def command(self, payload):
+        self.send(payload)
+        return self.receive()
+
+
+def free_port():
+    """A TCP port nobody listens on, for host/z80sim -t."""
+    s = socket.socket()
+    s.bind(("127.0.0.1", 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def connect(host, port, timeout=5.0):
+    """A TCP connection, retried while the other end starts up."""
+    deadline = time.time() + timeout
+    while True:
+        try:
+            return socket.create_connection((host, port))
+        except OSError:
+            if time.time() > deadline:
+                raise
+            time.sleep(0.05)
+
+
+class Serial:
+    """A serial line (or pty) in raw mode, with the socket calls Remote
+    uses."""
+
+    def __init__(self, path, baud=None):
+        self.fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+        attr = termios.tcgetattr(self.fd)
+        attr[0] = 0                                 # iflag
+        attr[1] = 0                                 # oflag
+        attr[2] = termios.CS8 | termios.CREAD | termios.CLOCAL
+        attr[3] = 0                                 # lflag
+        if baud:
+            attr[4] = attr[5] = getattr(termios, "B%d" % baud)
+        attr[6][termios.VMIN] = 1
+        attr[6][termios.VTIME] = 0
+        termios.tcsetattr(self.fd, termios.TCSANOW, attr)
+
+    def sendall(self, data):
+        while data:
+            data = data[os.write(self.fd, data):]
+
+    def recv(self, size):
+        return os.read(self.fd, size)
+
+
+def open_target(target, baud=None):
+    """HOST:PORT (or :PORT) is TCP, anything else a serial device."""
+    if ":" in target and not target.startswith("/"):
+        host, port = target.rsplit(":", 1)
+        return connect(host or "127.0.0.1", int(port))
+    return Serial(target, baud)
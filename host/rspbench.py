@@ -0,0 +1,237 @@
+#!/usr/bin/env python3
+"""rspbench -- time remote protocol operations on the stub, in z80sim
+
+Starts host/z80sim on monitor.hex, talks the remote protocol to the
+stub directly and times each operation by the emulator's idle log
+(z80sim -l): the T-states from the stub waiting for the request to the
+stub waiting again once it has taken the last byte (the ack, without
+QStartNoAckMode).  With -b the received bytes are paced at that baud
+rate inside the emulator, so the T-states include the stub waiting on
+the line, and ms adds the time the reply needs on the wire.
+
+The stub must be built without UART_RX_IRQ.  Output is CSV on stdout,
+one line per image and operation with per repetition figures:
+
+    image,op,reps,bytes_to_stub,bytes_from_stub,round_trips,tstates,ms
+
+Given several images, e.g. a build before and after a change to
+mem2hex or hex2mem, each runs in a fresh emulator with the same
+operations; the m1K and M1K rows are the T-states per KB of those.
+The verify rows check a 16 or 32 KB image at 0 after a load, by
+reading it back with m or by one qCRC packet.
+"""
+
+import argparse
+import os
+import random
+import subprocess
+import sys
+import threading
+import time
+
+from rsp import Remote, connect, free_port
+
+# scratch RAM for downloads and the test loop, above the monitor stack
+DOWNLOAD_ADDR = 0xC000
+LOOP_ADDR = 0xD000
+# ld b,16 / djnz $ / nop (breakpoint here) / jr LOOP_ADDR
+LOOP_CODE = bytes([0x06, 0x10, 0x10, 0xFE, 0x00, 0x18, 0xF9])
+LOOP_BREAK = LOOP_ADDR + 4
+# single steps through each decode table of doSStep: ex de,hl, ld a,r
+# and dec ix, all late in the tables
+STEP_ADDR = 0xD010
+STEP_CODE = [("s_main", bytes([0xEB])), ("s_ed", bytes([0xED, 0x5F])),
+             ("s_ix", bytes([0xDD, 0x2B]))]
+
+
+class IdleLog(threading.Thread):
+    """Follows the 'idle CYCLES CONSUMED SENT' lines of z80sim -l -."""
+
+    def __init__(self, stream):
+        threading.Thread.__init__(self, daemon=True)
+        self.stream = stream
+        self.cond = threading.Condition()
+        self.last = None
+
+    def run(self):
+        for line in self.stream:
+            fields = line.split()
+            if len(fields) == 4 and fields[0] == b"idle":
+                with self.cond:
+                    self.last = tuple(int(f) for f in fields[1:])
+                    self.cond.notify_all()
+
+    def wait(self, consumed, timeout=10.0):
+        """Wait for the stub to take consumed bytes and go idle, return
+        the T-state count then."""
+        deadline = time.time() + timeout
+        with self.cond:
+            while self.last is None or self.last[1] != consumed:
+                left = deadline - time.time()
+                if left <= 0:
+                    raise RuntimeError("stub did not go idle")
+                self.cond.wait(left)
+            return self.last[0]
+
+
+def expect_ok(reply, what):
+    if reply != b"OK":
+        raise RuntimeError("%s: %r" % (what, reply))
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("hexfile", nargs="+",
+                        help="the stub, monitor.hex, or builds to compare")
+    parser.add_argument("--sim", default=os.path.join(here, "z80sim"),
+                        help="the emulator (default host/z80sim)")
+    parser.add_argument("-b", "--baud", type=int, default=0,
+                        help="simulated baud rate (default unpaced)")
+    parser.add_argument("-c", "--clock", type=int, default=4000000,
+                        help="Z80 clock in Hz (default 4000000)")
+    parser.add_argument("-n", "--reps", type=int, default=10,
+                        help="repetitions of each operation")
+    parser.add_argument("-d", "--download", type=int, default=4096,
+                        help="bytes for the M and X downloads")
+    parser.add_argument("--noack", action="store_true",
+                        help="negotiate QStartNoAckMode first")
+    args = parser.parse_args()
+
+    print("image,op,reps,bytes_to_stub,bytes_from_stub,round_trips,"
+          "tstates,ms")
+    for hexfile in args.hexfile:
+        port = free_port()
+        cmd = [args.sim, "-t", str(port), "-l", "-", "-c", str(args.clock)]
+        if args.baud:
+            cmd += ["-b", str(args.baud)]
+        sim = subprocess.Popen(cmd + [hexfile], stdout=subprocess.PIPE,
+                               stderr=subprocess.DEVNULL)
+        log = IdleLog(sim.stdout)
+        log.start()
+        try:
+            remote = Remote(connect("127.0.0.1", port))
+            run(remote, log, args, os.path.basename(hexfile))
+        finally:
+            sim.terminate()
+            sim.wait()
+
+
+def run(remote, log, args, image):
+    # the stub is still waiting for an ack of its first stop reply
+    remote.write(b"+")
+    log.wait(remote.sent)
+
+    size = 0x100
+    for feature in remote.command(b"qSupported").split(b";"):
+        if feature.startswith(b"PacketSize="):
+            size = int(feature[len(b"PacketSize="):], 16)
+    if args.noack:
+        expect_ok(remote.command(b"QStartNoAckMode"), "QStartNoAckMode")
+        remote.ack = False
+    expect_ok(remote.command(b"M%x,%x:%s" % (LOOP_ADDR, len(LOOP_CODE),
+                                             LOOP_CODE.hex().encode())),
+              "loading the test loop")
+    for i, (_, code) in enumerate(STEP_CODE):
+        expect_ok(remote.command(b"M%x,%x:%s" % (STEP_ADDR + 4 * i, len(code),
+                                                 code.hex().encode())),
+                  "loading the step code")
+
+    rng = random.Random(1)
+    data = bytes(rng.randrange(256) for _ in range(args.download))
+    kb = bytes(rng.randrange(256) for _ in range(1024))
+    mmax = (size - 1) // 2
+
+    def read(n):
+        return lambda: remote.command(b"m0,%x" % n)
+
+    def read_kb():
+        # 1 KB in the largest m packets, all mem2hex but for the framing
+        for off in range(0, 1024, mmax):
+            remote.command(b"m%x,%x" % (off, min(mmax, 1024 - off)))
+
+    def verify_m(n):
+        # read the image back to compare on the host
+        def op():
+            for off in range(0, n, mmax):
+                remote.command(b"m%x,%x" % (off, min(mmax, n - off)))
+        return op
+
+    def verify_crc(n):
+        def op():
+            reply = remote.command(b"qCRC:0,%x" % n)
+            if reply[0:1] != b"C":
+                raise RuntimeError("qCRC: %r" % reply)
+        return op
+
+    def download(binary, data=data):
+        def op():
+            # the largest payload that fits a packet, X escaping aside
+            header = 16
+            chunk = (size - header) if binary else (size - header) // 2
+            if binary:
+                chunk -= chunk // 8     # room for escapes in random data
+            for off in range(0, len(data), chunk):
+                part = data[off:off + chunk]
+                if binary:
+                    payload = b"X%x,%x:" % (DOWNLOAD_ADDR + off, len(part)) + part
+                else:
+                    payload = (b"M%x,%x:" % (DOWNLOAD_ADDR + off, len(part))
+                               + part.hex().encode())
+                expect_ok(remote.command(payload), "download")
+        return op
+
+    def step(addr):
+        return lambda: remote.command(b"s%x" % addr)
+
+    def cont():
+        remote.command(b"c%x" % LOOP_ADDR)
+
+    ops = [
+        ("g", lambda: remote.command(b"g")),
+        ("m1", read(1)),
+        ("m16", read(16)),
+        ("m127", read(127)),
+        ("m%d" % mmax, read(mmax)),
+        ("M%d" % args.download, download(False)),
+        ("X%d" % args.download, download(True)),
+        ("m1K", read_kb),
+        ("M1K", download(False, kb)),
+        ("verify16K_m", verify_m(0x4000)),
+        ("verify16K_qCRC", verify_crc(0x4000)),
+        ("verify32K_m", verify_m(0x8000)),
+        ("verify32K_qCRC", verify_crc(0x8000)),
+        ("s", step(LOOP_ADDR)),
+    ] + [(name, step(STEP_ADDR + 4 * i))
+         for i, (name, _) in enumerate(STEP_CODE)]
+
+    for name, op in ops:
+        measure(remote, log, args, image, name, op)
+
+    expect_ok(remote.command(b"Z0,%x,1" % LOOP_BREAK), "Z0")
+    measure(remote, log, args, image, "c_to_break", cont)
+    expect_ok(remote.command(b"z0,%x,1" % LOOP_BREAK), "z0")
+
+
+def measure(remote, log, args, image, name, op):
+    start = log.wait(remote.sent)
+    sent, received, packets = remote.sent, remote.received, remote.packets
+    for _ in range(args.reps):
+        op()
+    end = log.wait(remote.sent)
+
+    reps = args.reps
+    to_stub = (remote.sent - sent) / reps
+    from_stub = (remote.received - received) / reps
+    tstates = (end - start) / reps
+    ms = tstates * 1000.0 / args.clock
+    if args.baud:
+        ms += from_stub * 10 * 1000.0 / args.baud
+    print("%s,%s,%d,%.0f,%.0f,%.0f,%.0f,%.3f"
+          % (image, name, reps, to_stub, from_stub,
+             (remote.packets - packets) / reps, tstates, ms))
+    sys.stdout.flush()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,952 @@
+/* z80.c -- cycle counting Z80 core for the z80sim host emulator
+
+   Opcodes are decoded from their x/y/z fields rather than with a 256
+   way switch per prefix.  Timings are the documented T-states, memory
+   contention and the undocumented MEMPTR flag bits are not modelled. */
+
+#include "z80.h"
+
+#define FLAG_C  0x01
+#define FLAG_N  0x02
+#define FLAG_PV 0x04
+#define FLAG_X  0x08
+#define FLAG_H  0x10
+#define FLAG_Y  0x20
+#define FLAG_Z  0x40
+#define FLAG_S  0x80
+
+#define A       (cpu->r[REG_A])
+#define F       (cpu->r[REG_F])
+
+#define RD(addr)        (cpu->read (cpu->user, (uint16_t) (addr)))
+#define WR(addr, v)     (cpu->write (cpu->user, (uint16_t) (addr), (uint8_t) (v)))
+
+/* which register stands for HL: none, IX or IY */
+#define IDX_HL  0
+#define IDX_IX  1
+#define IDX_IY  2
+
+static uint8_t sz53[256];       /* S, Z, Y and X of a result */
+static uint8_t sz53p[256];      /* the same and parity */
+static int tables_done;
+
+static void
+init_tables (void)
+{
+  int i, j, parity;
+
+  for (i = 0; i < 256; i++)
+    {
+      sz53[i] = i & (FLAG_S | FLAG_Y | FLAG_X);
+      if (!i)
+        sz53[i] |= FLAG_Z;
+      for (parity = 1, j = i; j; j >>= 1)
+        parity ^= j & 1;
+      sz53p[i] = sz53[i] | (parity ? FLAG_PV : 0);
+    }
+  tables_done = 1;
+}
+
+/* opcode fetch, an M1 cycle */
+static uint8_t
+fetch_op (z80 *cpu)
+{
+  cpu->refresh = (cpu->refresh & 0x80) | ((cpu->refresh + 1) & 0x7f);
+  return RD (cpu->pc++);
+}
+
+static uint8_t
+fetch8 (z80 *cpu)
+{
+  return RD (cpu->pc++);
+}
+
+static uint16_t
+fetch16 (z80 *cpu)
+{
+  uint16_t v = fetch8 (cpu);
+
+  return v | (fetch8 (cpu) << 8);
+}
+
+static uint16_t
+rd16 (z80 *cpu, uint16_t addr)
+{
+  return RD (addr) | (RD (addr + 1) << 8);
+}
+
+static void
+wr16 (z80 *cpu, uint16_t addr, uint16_t v)
+{
+  WR (addr, v);
+  WR (addr + 1, v >> 8);
+}
+
+static void
+push (z80 *cpu, uint16_t v)
+{
+  cpu->sp -= 2;
+  wr16 (cpu, cpu->sp, v);
+}
+
+static uint16_t
+pop (z80 *cpu)
+{
+  uint16_t v = rd16 (cpu, cpu->sp);
+
+  cpu->sp += 2;
+  return v;
+}
+
+static uint16_t
+get_pair (z80 *cpu, int hi)
+{
+  return (cpu->r[hi] << 8) | cpu->r[hi + 1];
+}
+
+static void
+set_pair (z80 *cpu, int hi, uint16_t v)
+{
+  cpu->r[hi] = v >> 8;
+  cpu->r[hi + 1] = v;
+}
+
+static uint16_t
+get_hl (z80 *cpu, int idx)
+{
+  if (idx == IDX_IX)
+    return cpu->ix;
+  if (idx == IDX_IY)
+    return cpu->iy;
+  return get_pair (cpu, REG_H);
+}
+
+static void
+set_hl (z80 *cpu, int idx, uint16_t v)
+{
+  if (idx == IDX_IX)
+    cpu->ix = v;
+  else if (idx == IDX_IY)
+    cpu->iy = v;
+  else
+    set_pair (cpu, REG_H, v);
+}
+
+/* rp[p]: BC, DE, HL (or IX/IY), SP */
+static uint16_t
+get_rp (z80 *cpu, int p, int idx)
+{
+  if (p == 3)
+    return cpu->sp;
+  if (p == 2)
+    return get_hl (cpu, idx);
+  return get_pair (cpu, 2 * p);
+}
+
+static void
+set_rp (z80 *cpu, int p, int idx, uint16_t v)
+{
+  if (p == 3)
+    cpu->sp = v;
+  else if (p == 2)
+    set_hl (cpu, idx, v);
+  else
+    set_pair (cpu, 2 * p, v);
+}
+
+/* register r[rc], H and L being IXH/IXL or IYH/IYL under a prefix */
+static uint8_t
+get8 (z80 *cpu, int rc, int idx)
+{
+  if (idx != IDX_HL && (rc == REG_H || rc == REG_L))
+    {
+      uint16_t x = get_hl (cpu, idx);
+
+      return (rc == REG_H) ? x >> 8 : x & 0xff;
+    }
+  return cpu->r[rc];
+}
+
+static void
+set8 (z80 *cpu, int rc, int idx, uint8_t v)
+{
+  if (idx != IDX_HL && (rc == REG_H || rc == REG_L))
+    {
+      uint16_t x = get_hl (cpu, idx);
+
+      if (rc == REG_H)
+        x = (x & 0x00ff) | (v << 8);
+      else
+        x = (x & 0xff00) | v;
+      set_hl (cpu, idx, x);
+    }
+  else
+    cpu->r[rc] = v;
+}
+
+/* address of the (HL) operand, fetching the displacement under a prefix */
+static uint16_t
+hl_addr (z80 *cpu, int idx)
+{
+  if (idx == IDX_HL)
+    return get_pair (cpu, REG_H);
+  return get_hl (cpu, idx) + (int8_t) fetch8 (cpu);
+}
+
+static int
+condition (z80 *cpu, int cc)
+{
+  switch (cc)
+    {
+    case 0: return !(F & FLAG_Z);
+    case 1: return F & FLAG_Z;
+    case 2: return !(F & FLAG_C);
+    case 3: return F & FLAG_C;
+    case 4: return !(F & FLAG_PV);
+    case 5: return F & FLAG_PV;
+    case 6: return !(F & FLAG_S);
+    default: return F & FLAG_S;
+    }
+}
+
+/* ---------- ALU ---------- */
+
+static void
+alu (z80 *cpu, int op, uint8_t v)
+{
+  unsigned int res;
+  int carry = 0;
+
+  switch (op)
+    {
+    case 1:                     /* adc */
+      carry = F & FLAG_C;
+      /* fall through */
+    case 0:                     /* add */
+      res = A + v + carry;
+      F = sz53[res & 0xff] | ((res >> 8) & FLAG_C) | ((A ^ v ^ res) & FLAG_H)
+          | ((((A ^ ~v) & (A ^ res)) & 0x80) >> 5);
+      A = res;
+      break;
+    case 3:                     /* sbc */
+      carry = F & FLAG_C;
+      /* fall through */
+    case 2:                     /* sub */
+    case 7:                     /* cp */
+      res = A - v - carry;
+      F = sz53[res & 0xff] | FLAG_N | ((res >> 8) & FLAG_C)
+          | ((A ^ v ^ res) & FLAG_H) | ((((A ^ v) & (A ^ res)) & 0x80) >> 5);
+      if (op == 7)              /* X and Y come from the operand */
+        F = (F & ~(FLAG_X | FLAG_Y)) | (v & (FLAG_X | FLAG_Y));
+      else
+        A = res;
+      break;
+    case 4:                     /* and */
+      A &= v;
+      F = sz53p[A] | FLAG_H;
+      break;
+    case 5:                     /* xor */
+      A ^= v;
+      F = sz53p[A];
+      break;
+    case 6:                     /* or */
+      A |= v;
+      F = sz53p[A];
+      break;
+    }
+}
+
+static uint8_t
+inc8 (z80 *cpu, uint8_t v)
+{
+  uint8_t res = v + 1;
+
+  F = (F & FLAG_C) | sz53[res] | ((res & 0x0f) ? 0 : FLAG_H)
+      | ((v == 0x7f) ? FLAG_PV : 0);
+  return res;
+}
+
+static uint8_t
+dec8 (z80 *cpu, uint8_t v)
+{
+  uint8_t res = v - 1;
+
+  F = (F & FLAG_C) | FLAG_N | sz53[res] | ((v & 0x0f) ? 0 : FLAG_H)
+      | ((v == 0x80) ? FLAG_PV : 0);
+  return res;
+}
+
+static uint16_t
+add16 (z80 *cpu, uint16_t a, uint16_t b)
+{
+  unsigned long res = (unsigned long) a + b;
+
+  F = (F & (FLAG_S | FLAG_Z | FLAG_PV)) | ((res >> 16) & FLAG_C)
+      | (((a ^ b ^ res) >> 8) & FLAG_H) | ((res >> 8) & (FLAG_X | FLAG_Y));
+  return res;
+}
+
+static uint16_t
+adc16 (z80 *cpu, uint16_t a, uint16_t b)
+{
+  unsigned long res = (unsigned long) a + b + (F & FLAG_C);
+
+  F = ((res >> 16) & FLAG_C) | (((a ^ b ^ res) >> 8) & FLAG_H)
+      | ((res >> 8) & (FLAG_S | FLAG_X | FLAG_Y))
+      | ((res & 0xffff) ? 0 : FLAG_Z)
+      | (((~(a ^ b) & (a ^ res)) & 0x8000) >> 13);
+  return res;
+}
+
+static uint16_t
+sbc16 (z80 *cpu, uint16_t a, uint16_t b)
+{
+  unsigned long res = (unsigned long) a - b - (F & FLAG_C);
+
+  F = FLAG_N | ((res >> 16) & FLAG_C) | (((a ^ b ^ res) >> 8) & FLAG_H)
+      | ((res >> 8) & (FLAG_S | FLAG_X | FLAG_Y))
+      | ((res & 0xffff) ? 0 : FLAG_Z)
+      | ((((a ^ b) & (a ^ res)) & 0x8000) >> 13);
+  return res;
+}
+
+/* CB rotates and shifts: rlc rrc rl rr sla sra sll srl */
+static uint8_t
+rotate (z80 *cpu, int op, uint8_t v)
+{
+  uint8_t res, carry;
+
+  switch (op)
+    {
+    case 0: carry = v >> 7; res = (v << 1) | carry; break;
+    case 1: carry = v & 1; res = (v >> 1) | (carry << 7); break;
+    case 2: carry = v >> 7; res = (v << 1) | (F & FLAG_C); break;
+    case 3: carry = v & 1; res = (v >> 1) | ((F & FLAG_C) << 7); break;
+    case 4: carry = v >> 7; res = v << 1; break;
+    case 5: carry = v & 1; res = (v >> 1) | (v & 0x80); break;
+    case 6: carry = v >> 7; res = (v << 1) | 1; break;
+    default: carry = v & 1; res = v >> 1; break;
+    }
+  F = sz53p[res] | carry;
+  return res;
+}
+
+static void
+bit (z80 *cpu, int n, uint8_t v)
+{
+  F = (F & FLAG_C) | FLAG_H | (sz53p[v & (1 << n)] & ~(FLAG_X | FLAG_Y))
+      | (v & (FLAG_X | FLAG_Y));
+}
+
+static void
+daa (z80 *cpu)
+{
+  uint8_t fix = 0, carry = F & FLAG_C, half;
+
+  if ((F & FLAG_H) || (A & 0x0f) > 9)
+    fix = 0x06;
+  if (carry || A > 0x99)
+    {
+      fix |= 0x60;
+      carry = FLAG_C;
+    }
+  if (F & FLAG_N)
+    {
+      half = ((F & FLAG_H) && (A & 0x0f) < 6) ? FLAG_H : 0;
+      A -= fix;
+    }
+  else
+    {
+      half = ((A & 0x0f) > 9) ? FLAG_H : 0;
+      A += fix;
+    }
+  F = sz53p[A] | (F & FLAG_N) | carry | half;
+}
+
+/* ---------- CB and DD CB / FD CB ---------- */
+
+static int
+exec_cb (z80 *cpu, int idx)
+{
+  uint16_t addr = 0;
+  uint8_t op, v, res;
+  int x, y, z;
+
+  /* DD CB d op: the displacement comes before the opcode */
+  if (idx != IDX_HL)
+    {
+      addr = hl_addr (cpu, idx);
+      op = fetch8 (cpu);
+    }
+  else
+    op = fetch_op (cpu);
+  x = op >> 6;
+  y = (op >> 3) & 7;
+  z = op & 7;
+
+  if (idx == IDX_HL && z != 6)
+    v = cpu->r[z];
+  else
+    {
+      if (idx == IDX_HL)
+        addr = get_pair (cpu, REG_H);
+      v = RD (addr);
+    }
+
+  switch (x)
+    {
+    case 0: res = rotate (cpu, y, v); break;
+    case 1:
+      bit (cpu, y, v);
+      if (idx != IDX_HL)
+        return 16;              /* 20 with the prefix */
+      return (z == 6) ? 12 : 8;
+    case 2: res = v & ~(1 << y); break;
+    default: res = v | (1 << y); break;
+    }
+
+  if (idx != IDX_HL)
+    {
+      WR (addr, res);
+      if (z != 6)               /* undocumented copy to a register */
+        cpu->r[z] = res;
+      return 19;                /* 23 with the prefix */
+    }
+  if (z == 6)
+    {
+      WR (addr, res);
+      return 15;
+    }
+  cpu->r[z] = res;
+  return 8;
+}
+
+/* ---------- ED ---------- */
+
+static int
+exec_block (z80 *cpu, int y, int z)
+{
+  uint16_t hl = get_pair (cpu, REG_H);
+  uint16_t bc = get_pair (cpu, REG_B);
+  int step = (y & 1) ? -1 : 1;  /* ldd, cpd, ind, outd */
+  int repeat = y & 2;
+  uint8_t v, n;
+  unsigned int k;
+
+  switch (z)
+    {
+    case 0:                     /* ldi */
+      v = RD (hl);
+      WR (get_pair (cpu, REG_D), v);
+      set_pair (cpu, REG_D, get_pair (cpu, REG_D) + step);
+      set_pair (cpu, REG_H, hl + step);
+      set_pair (cpu, REG_B, --bc);
+      n = v + A;
+      F = (F & (FLAG_S | FLAG_Z | FLAG_C)) | (bc ? FLAG_PV : 0)
+          | (n & FLAG_X) | ((n << 4) & FLAG_Y);
+      if (repeat && bc)
+        break;
+      return 16;
+
+    case 1:                     /* cpi */
+      {
+        uint8_t res, half;
+
+        v = RD (hl);
+        res = A - v;
+        set_pair (cpu, REG_H, hl + step);
+        set_pair (cpu, REG_B, --bc);
+        half = (A ^ v ^ res) & FLAG_H;
+        n = res - (half ? 1 : 0);
+        F = (F & FLAG_C) | FLAG_N | (sz53[res] & ~(FLAG_X | FLAG_Y)) | half
+            | (bc ? FLAG_PV : 0) | (n & FLAG_X) | ((n << 4) & FLAG_Y);
+        if (repeat && bc && res)
+          break;
+        return 16;
+      }
+
+    case 2:                     /* ini */
+      v = cpu->in (cpu->user, bc);
+      WR (hl, v);
+      cpu->r[REG_B]--;
+      set_pair (cpu, REG_H, hl + step);
+      k = v + ((cpu->r[REG_C] + step) & 0xff);
+      goto io_flags;
+
+    default:                    /* outi */
+      v = RD (hl);
+      cpu->r[REG_B]--;
+      cpu->out (cpu->user, get_pair (cpu, REG_B), v);
+      set_pair (cpu, REG_H, hl + step);
+      k = v + cpu->r[REG_L];
+    io_flags:
+      F = sz53[cpu->r[REG_B]] | ((v >> 6) & FLAG_N)
+          | ((k > 0xff) ? FLAG_H | FLAG_C : 0)
+          | (sz53p[(k & 7) ^ cpu->r[REG_B]] & FLAG_PV);
+      if (repeat && cpu->r[REG_B])
+        break;
+      return 16;
+    }
+
+  cpu->pc -= 2;                 /* go round again */
+  return 21;
+}
+
+static int
+exec_ed (z80 *cpu)
+{
+  uint8_t op = fetch_op (cpu);
+  int x = op >> 6, y = (op >> 3) & 7, z = op & 7;
+  int p = y >> 1, q = y & 1;
+  uint16_t addr;
+  uint8_t v;
+
+  if (x == 2 && z <= 3 && y >= 4)
+    return exec_block (cpu, y - 4, z);
+  if (x != 1)
+    return 8;                   /* a two byte nop */
+
+  switch (z)
+    {
+    case 0:                     /* in r,(c) */
+      v = cpu->in (cpu->user, get_pair (cpu, REG_B));
+      if (y != 6)
+        cpu->r[y] = v;
+      F = (F & FLAG_C) | sz53p[v];
+      return 12;
+    case 1:                     /* out (c),r */
+      cpu->out (cpu->user, get_pair (cpu, REG_B), (y == 6) ? 0 : cpu->r[y]);
+      return 12;
+    case 2:
+      if (q)
+        set_pair (cpu, REG_H,
+                  adc16 (cpu, get_pair (cpu, REG_H), get_rp (cpu, p, IDX_HL)));
+      else
+        set_pair (cpu, REG_H,
+                  sbc16 (cpu, get_pair (cpu, REG_H), get_rp (cpu, p, IDX_HL)));
+      return 15;
+    case 3:
+      addr = fetch16 (cpu);
+      if (q)
+        set_rp (cpu, p, IDX_HL, rd16 (cpu, addr));
+      else
+        wr16 (cpu, addr, get_rp (cpu, p, IDX_HL));
+      return 20;
+    case 4:                     /* neg */
+      v = A;
+      A = 0;
+      alu (cpu, 2, v);
+      return 8;
+    case 5:                     /* retn, reti */
+      cpu->iff1 = cpu->iff2;
+      cpu->pc = pop (cpu);
+      return 14;
+    case 6:
+      cpu->im = (y & 3) ? (y & 3) - 1 : 0;
+      return 8;
+    default:
+      switch (y)
+        {
+        case 0: cpu->i = A; return 9;
+        case 1: cpu->refresh = A; return 9;
+        case 2:
+        case 3:
+          A = (y == 2) ? cpu->i : cpu->refresh;
+          F = (F & FLAG_C) | sz53[A] | (cpu->iff2 ? FLAG_PV : 0);
+          return 9;
+        case 4:                 /* rrd */
+          addr = get_pair (cpu, REG_H);
+          v = RD (addr);
+          WR (addr, (A << 4) | (v >> 4));
+          A = (A & 0xf0) | (v & 0x0f);
+          F = (F & FLAG_C) | sz53p[A];
+          return 18;
+        case 5:                 /* rld */
+          addr = get_pair (cpu, REG_H);
+          v = RD (addr);
+          WR (addr, (v << 4) | (A & 0x0f));
+          A = (A & 0xf0) | (v >> 4);
+          F = (F & FLAG_C) | sz53p[A];
+          return 18;
+        default:
+          return 8;
+        }
+    }
+}
+
+/* ---------- unprefixed, DD and FD ---------- */
+
+static int
+exec_main (z80 *cpu, uint8_t op, int idx)
+{
+  int x = op >> 6, y = (op >> 3) & 7, z = op & 7;
+  int p = y >> 1, q = y & 1;
+  int extra = (idx != IDX_HL) ? 4 : 0;   /* the prefix */
+  uint16_t addr, v16;
+  uint8_t v;
+  int i;
+
+  switch (x)
+    {
+    case 0:
+      switch (z)
+        {
+        case 0:
+          switch (y)
+            {
+            case 0:
+              return 4 + extra;
+            case 1:                     /* ex af,af' */
+              v = A; A = cpu->alt[REG_A]; cpu->alt[REG_A] = v;
+              v = F; F = cpu->alt[REG_F]; cpu->alt[REG_F] = v;
+              return 4 + extra;
+            case 2:                     /* djnz */
+              v = fetch8 (cpu);
+              if (--cpu->r[REG_B])
+                {
+                  cpu->pc += (int8_t) v;
+                  return 13 + extra;
+                }
+              return 8 + extra;
+            default:                    /* jr, jr cc */
+              v = fetch8 (cpu);
+              if (y == 3 || condition (cpu, y - 4))
+                {
+                  cpu->pc += (int8_t) v;
+                  return 12 + extra;
+                }
+              return 7 + extra;
+            }
+        case 1:
+          if (q)
+            {
+              set_hl (cpu, idx, add16 (cpu, get_hl (cpu, idx),
+                                       get_rp (cpu, p, idx)));
+              return 11 + extra;
+            }
+          set_rp (cpu, p, idx, fetch16 (cpu));
+          return 10 + extra;
+        case 2:
+          switch (p)
+            {
+            case 0:
+            case 1:
+              addr = get_pair (cpu, 2 * p);
+              if (q)
+                A = RD (addr);
+              else
+                WR (addr, A);
+              return 7 + extra;
+            case 2:
+              addr = fetch16 (cpu);
+              if (q)
+                set_hl (cpu, idx, rd16 (cpu, addr));
+              else
+                wr16 (cpu, addr, get_hl (cpu, idx));
+              return 16 + extra;
+            default:
+              addr = fetch16 (cpu);
+              if (q)
+                A = RD (addr);
+              else
+                WR (addr, A);
+              return 13 + extra;
+            }
+        case 3:
+          set_rp (cpu, p, idx, get_rp (cpu, p, idx) + (q ? -1 : 1));
+          return 6 + extra;
+        case 4:
+        case 5:
+          if (y == 6)
+            {
+              addr = hl_addr (cpu, idx);
+              v = RD (addr);
+              WR (addr, (z == 4) ? inc8 (cpu, v) : dec8 (cpu, v));
+              return 11 + 3 * extra;
+            }
+          v = get8 (cpu, y, idx);
+          set8 (cpu, y, idx, (z == 4) ? inc8 (cpu, v) : dec8 (cpu, v));
+          return 4 + extra;
+        case 6:
+          if (y == 6)
+            {
+              addr = hl_addr (cpu, idx);
+              WR (addr, fetch8 (cpu));
+              return 10 + extra + (extra ? 5 : 0);
+            }
+          set8 (cpu, y, idx, fetch8 (cpu));
+          return 7 + extra;
+        default:
+          switch (y)
+            {
+            case 0:                     /* rlca */
+              A = (A << 1) | (A >> 7);
+              F = (F & (FLAG_S | FLAG_Z | FLAG_PV))
+                  | (A & (FLAG_X | FLAG_Y | FLAG_C));
+              break;
+            case 1:                     /* rrca */
+              v = A & 1;
+              A = (A >> 1) | (A << 7);
+              F = (F & (FLAG_S | FLAG_Z | FLAG_PV)) | (A & (FLAG_X | FLAG_Y)) | v;
+              break;
+            case 2:                     /* rla */
+              v = A >> 7;
+              A = (A << 1) | (F & FLAG_C);
+              F = (F & (FLAG_S | FLAG_Z | FLAG_PV)) | (A & (FLAG_X | FLAG_Y)) | v;
+              break;
+            case 3:                     /* rra */
+              v = A & 1;
+              A = (A >> 1) | ((F & FLAG_C) << 7);
+              F = (F & (FLAG_S | FLAG_Z | FLAG_PV)) | (A & (FLAG_X | FLAG_Y)) | v;
+              break;
+            case 4:
+              daa (cpu);
+              break;
+            case 5:                     /* cpl */
+              A = ~A;
+              F = (F & (FLAG_S | FLAG_Z | FLAG_PV | FLAG_C)) | FLAG_H | FLAG_N
+                  | (A & (FLAG_X | FLAG_Y));
+              break;
+            case 6:                     /* scf */
+              F = (F & (FLAG_S | FLAG_Z | FLAG_PV)) | FLAG_C
+                  | (A & (FLAG_X | FLAG_Y));
+              break;
+            default:                    /* ccf */
+              F = (F & (FLAG_S | FLAG_Z | FLAG_PV))
+                  | ((F & FLAG_C) ? FLAG_H : FLAG_C) | (A & (FLAG_X | FLAG_Y));
+              break;
+            }
+          return 4 + extra;
+        }
+
+    case 1:
+      if (op == 0x76)                   /* halt */
+        {
+          cpu->halted = 1;
+          return 4 + extra;
+        }
+      /* with (IX+d) on one side the other register is plain H or L */
+      if (y == 6)
+        {
+          WR (hl_addr (cpu, idx), cpu->r[z]);
+          return 7 + 3 * extra;
+        }
+      if (z == 6)
+        {
+          cpu->r[y] = RD (hl_addr (cpu, idx));
+          return 7 + 3 * extra;
+        }
+      set8 (cpu, y, idx, get8 (cpu, z, idx));
+      return 4 + extra;
+
+    case 2:
+      if (z == 6)
+        {
+          alu (cpu, y, RD (hl_addr (cpu, idx)));
+          return 7 + 3 * extra;
+        }
+      alu (cpu, y, get8 (cpu, z, idx));
+      return 4 + extra;
+
+    default:
+      switch (z)
+        {
+        case 0:                         /* ret cc */
+          if (condition (cpu, y))
+            {
+              cpu->pc = pop (cpu);
+              return 11 + extra;
+            }
+          return 5 + extra;
+        case 1:
+          if (!q)                       /* pop */
+            {
+              v16 = pop (cpu);
+              if (p == 3)
+                {
+                  A = v16 >> 8;
+                  F = v16;
+                }
+              else
+                set_rp (cpu, p, idx, v16);
+              return 10 + extra;
+            }
+          switch (p)
+            {
+            case 0:
+              cpu->pc = pop (cpu);
+              return 10 + extra;
+            case 1:                     /* exx */
+              for (i = REG_B; i <= REG_L; i++)
+                {
+                  v = cpu->r[i];
+                  cpu->r[i] = cpu->alt[i];
+                  cpu->alt[i] = v;
+                }
+              return 4 + extra;
+            case 2:                     /* jp (hl) */
+              cpu->pc = get_hl (cpu, idx);
+              return 4 + extra;
+            default:                    /* ld sp,hl */
+              cpu->sp = get_hl (cpu, idx);
+              return 6 + extra;
+            }
+        case 2:                         /* jp cc,nn */
+          addr = fetch16 (cpu);
+          if (condition (cpu, y))
+            cpu->pc = addr;
+          return 10 + extra;
+        case 3:
+          switch (y)
+            {
+            case 0:
+              cpu->pc = fetch16 (cpu);
+              return 10 + extra;
+            case 1:
+              return exec_cb (cpu, idx) + extra;
+            case 2:                     /* out (n),a */
+              cpu->out (cpu->user, (A << 8) | fetch8 (cpu), A);
+              return 11 + extra;
+            case 3:                     /* in a,(n) */
+              A = cpu->in (cpu->user, (A << 8) | fetch8 (cpu));
+              return 11 + extra;
+            case 4:                     /* ex (sp),hl */
+              v16 = rd16 (cpu, cpu->sp);
+              wr16 (cpu, cpu->sp, get_hl (cpu, idx));
+              set_hl (cpu, idx, v16);
+              return 19 + extra;
+            case 5:                     /* ex de,hl, never IX */
+              v16 = get_pair (cpu, REG_D);
+              set_pair (cpu, REG_D, get_pair (cpu, REG_H));
+              set_pair (cpu, REG_H, v16);
+              return 4 + extra;
+            case 6:
+              cpu->iff1 = cpu->iff2 = 0;
+              return 4 + extra;
+            default:
+              cpu->iff1 = cpu->iff2 = 1;
+              cpu->ei_delay = 1;
+              return 4 + extra;
+            }
+        case 4:                         /* call cc,nn */
+          addr = fetch16 (cpu);
+          if (condition (cpu, y))
+            {
+              push (cpu, cpu->pc);
+              cpu->pc = addr;
+              return 17 + extra;
+            }
+          return 10 + extra;
+        case 5:
+          if (!q)                       /* push */
+            {
+              push (cpu, (p == 3) ? (A << 8) | F : get_rp (cpu, p, idx));
+              return 11 + extra;
+            }
+          /* call nn; the prefixes are dealt with in exec */
+          addr = fetch16 (cpu);
+          push (cpu, cpu->pc);
+          cpu->pc = addr;
+          return 17 + extra;
+        case 6:
+          alu (cpu, y, fetch8 (cpu));
+          return 7 + extra;
+        default:                        /* rst */
+          push (cpu, cpu->pc);
+          cpu->pc = y * 8;
+          return 11 + extra;
+        }
+    }
+}
+
+static int
+exec (z80 *cpu)
+{
+  uint8_t op = fetch_op (cpu);
+  int t = 0;
+  int idx = IDX_HL;
+
+  /* a run of DD/FD prefixes, only the last one counts */
+  while (op == 0xDD || op == 0xFD)
+    {
+      if (idx != IDX_HL)
+        t += 4;
+      idx = (op == 0xDD) ? IDX_IX : IDX_IY;
+      op = fetch_op (cpu);
+    }
+
+  if (op == 0xED)
+    return t + ((idx != IDX_HL) ? 4 : 0) + exec_ed (cpu);
+  return t + exec_main (cpu, op, idx);
+}
+
+void
+z80_reset (z80 *cpu)
+{
+  int i;
+
+  if (!tables_done)
+    init_tables ();
+  for (i = 0; i < 8; i++)
+    cpu->r[i] = cpu->alt[i] = 0xff;
+  cpu->ix = cpu->iy = cpu->sp = 0xffff;
+  cpu->pc = 0;
+  cpu->i = cpu->refresh = 0;
+  cpu->iff1 = cpu->iff2 = cpu->im = 0;
+  cpu->halted = cpu->ei_delay = cpu->nmi_pending = 0;
+  cpu->cycles = 0;
+}
+
+void
+z80_nmi (z80 *cpu)
+{
+  cpu->nmi_pending = 1;
+}
+
+/* Run one instruction, or take an interrupt.  Return its T-states. */
+int
+z80_step (z80 *cpu)
+{
+  int t;
+
+  if (cpu->nmi_pending)
+    {
+      cpu->nmi_pending = 0;
+      cpu->halted = 0;
+      cpu->iff1 = 0;
+      cpu->refresh = (cpu->refresh & 0x80) | ((cpu->refresh + 1) & 0x7f);
+      push (cpu, cpu->pc);
+      cpu->pc = 0x66;
+      t = 11;
+    }
+  else if (cpu->int_line && cpu->iff1 && !cpu->ei_delay)
+    {
+      cpu->halted = 0;
+      cpu->iff1 = cpu->iff2 = 0;
+      cpu->refresh = (cpu->refresh & 0x80) | ((cpu->refresh + 1) & 0x7f);
+      push (cpu, cpu->pc);
+      if (cpu->im == 2)         /* 0xff on the data bus */
+        {
+          cpu->pc = rd16 (cpu, (cpu->i << 8) | 0xff);
+          t = 19;
+        }
+      else                      /* rst 38 either way */
+        {
+          cpu->pc = 0x38;
+          t = 13;
+        }
+    }
+  else if (cpu->halted)
+    {
+      cpu->refresh = (cpu->refresh & 0x80) | ((cpu->refresh + 1) & 0x7f);
+      t = 4;
+    }
+  else
+    {
+      cpu->ei_delay = 0;
+      t = exec (cpu);
+    }
+
+  cpu->cycles += t;
+  return t;
+}
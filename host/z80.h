@@ -0,0 +1,48 @@
+/* z80.h -- cycle counting Z80 core for the z80sim host emulator
+
+   The core runs one instruction (or interrupt acknowledge) per call to
+   z80_step and adds its T-states to cycles.  Memory and I/O go through
+   the callbacks, so the harness decides what is RAM, ROM and UART. */
+
+#ifndef Z80_H
+#define Z80_H
+
+#include <stdint.h>
+
+/* indexes in r[], in opcode register order; F sits in the (HL) slot */
+#define REG_B   0
+#define REG_C   1
+#define REG_D   2
+#define REG_E   3
+#define REG_H   4
+#define REG_L   5
+#define REG_F   6
+#define REG_A   7
+
+typedef struct z80 z80;
+
+struct z80
+  {
+    uint8_t r[8];               /* B C D E H L F A */
+    uint8_t alt[8];             /* B' C' D' E' H' L' F' A' */
+    uint16_t ix, iy, sp, pc;
+    uint8_t i, refresh;
+    uint8_t iff1, iff2, im;
+    uint8_t halted;
+    uint8_t ei_delay;           /* no interrupt right after EI */
+    uint8_t nmi_pending;        /* NMI edge, taken before the next opcode */
+    uint8_t int_line;           /* INT level, set by the harness */
+    unsigned long long cycles;  /* T-states since reset */
+
+    void *user;
+    uint8_t (*read) (void *user, uint16_t addr);
+    void (*write) (void *user, uint16_t addr, uint8_t value);
+    uint8_t (*in) (void *user, uint16_t port);
+    void (*out) (void *user, uint16_t port, uint8_t value);
+  };
+
+void z80_reset (z80 *cpu);
+int z80_step (z80 *cpu);
+void z80_nmi (z80 *cpu);
+
+#endif /* Z80_H */
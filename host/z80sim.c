@@ -0,0 +1,637 @@
+/* z80sim.c -- run the stub on the host, with its UART on a socket or pty
+
+   Loads monitor.hex into 64K of RAM and runs it on the z80.c core.  The
+   TARGET_Z80 UART is modelled on its two ports: reading UART_DATA takes
+   the next received byte, if any, and UART_RX_VALID says whether that
+   read got one.  INT is held while received bytes are waiting, which is
+   what a UART_RX_IRQ build expects.  gdb attaches with
+   "target remote :PORT", or to the pty printed at startup.
+
+   Every packet gdb sends is timed in T-states, from the stub reading
+   its '$' to the last byte the stub sends before the next packet (so
+   c and s include the time the inferior ran).  The table per packet
+   type is printed when gdb goes away.
+
+   With -b the received bytes are paced at that baud rate (10 bits a
+   byte at the -c clock), and -l writes a line
+
+        idle CYCLES CONSUMED SENT
+
+   each time the stub has taken every byte sent to it and is waiting
+   for more, for host/rspbench.py to time operations by.  The stub
+   only shows it waits by reading an empty UART_DATA, so this needs a
+   build without UART_RX_IRQ.
+
+   -k PORT pages BANK_COUNT banks of RAM into 0xC000-0xFFFF by writes
+   to PORT, which reads back, for a BANKED_MEMORY build of the stub. */
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+#include "z80.h"
+
+/* ports, as in z80-stub.c for TARGET_Z80 */
+#define UART_DATA          0x00
+#define UART_RX_VALID      0x01
+#define UART_RX_VALID_MASK 0x80
+#define NMI_FF_CLR         0x10
+
+/* banked memory, as the BANKED_MEMORY defaults in z80-stub.c */
+#define BANK_WINDOW     0xC000
+#define BANK_SIZE       0x4000
+#define BANK_COUNT      16
+
+#define RX_SIZE         4096
+#define TX_SIZE         4096
+#define POLL_PERIOD     4096    /* T-states between looks at the host */
+#define IDLE_POLLS      1024    /* quiet polls before sleeping in them */
+
+#define MAX_STATS       64
+#define NAME_LEN        16
+
+struct stat_entry
+  {
+    char name[NAME_LEN];
+    unsigned long count;
+    unsigned long long total, min, max;
+  };
+
+static z80 cpu;
+static uint8_t mem[65536];
+static uint8_t banks[BANK_COUNT][BANK_SIZE];
+static int bank_port = -1;      /* -k, none by default */
+static uint8_t bank;
+
+static int listen_fd = -1;
+static int host_fd = -1;        /* gdb's end: a TCP client or the pty */
+static int use_pty;
+
+static uint8_t rx_buf[RX_SIZE];
+static unsigned int rx_head, rx_tail;
+static uint8_t rx_latch, rx_valid;
+static uint8_t tx_buf[TX_SIZE];
+static unsigned int tx_len;
+static unsigned int idle_polls;
+
+/* baud rate pacing: the byte at rx_tail can be read from rx_ready_at */
+static unsigned long long byte_time;
+static unsigned long long rx_ready_at;
+
+/* idle log for rspbench */
+static FILE *idle_log;
+static unsigned long long rx_consumed, tx_sent;
+static unsigned long long logged_consumed = ~0ULL, logged_sent;
+
+/* the packet being timed */
+static int in_packet;           /* between '$' and '#' */
+static int timing;
+static char pkt_name[NAME_LEN];
+static unsigned int pkt_name_len;
+static int pkt_name_done;
+static unsigned long long pkt_start, last_tx;
+
+static struct stat_entry stats[MAX_STATS];
+static int nstats;
+static unsigned long long bytes_in, bytes_out;
+
+static volatile sig_atomic_t quit;
+
+static void
+on_signal (int sig)
+{
+  (void) sig;
+  quit = 1;
+}
+
+/* ---------- packet timing ---------- */
+
+static void
+stat_add (const char *name, unsigned long long t)
+{
+  struct stat_entry *s;
+
+  for (s = stats; s < stats + nstats; s++)
+    if (!strcmp (s->name, name))
+      break;
+  if (s == stats + nstats)
+    {
+      if (nstats == MAX_STATS)
+        return;
+      nstats++;
+      strcpy (s->name, name);
+      s->min = ~0ULL;
+    }
+  s->count++;
+  s->total += t;
+  if (t < s->min)
+    s->min = t;
+  if (t > s->max)
+    s->max = t;
+}
+
+static void
+packet_done (void)
+{
+  if (timing && last_tx >= pkt_start)
+    stat_add (pkt_name, last_tx - pkt_start);
+  timing = 0;
+}
+
+static void
+stats_report (void)
+{
+  struct stat_entry *s;
+
+  packet_done ();
+  if (!nstats)
+    return;
+  fprintf (stderr, "%-16s %8s %14s %10s %10s %10s\n",
+           "packet", "count", "T-states", "avg", "min", "max");
+  for (s = stats; s < stats + nstats; s++)
+    fprintf (stderr, "%-16s %8lu %14llu %10llu %10llu %10llu\n",
+             s->name, s->count, s->total, s->total / s->count,
+             s->min, s->max);
+  fprintf (stderr, "%llu bytes in, %llu bytes out, %llu T-states run\n",
+           bytes_in, bytes_out, cpu.cycles);
+  nstats = 0;
+  bytes_in = bytes_out = 0;
+}
+
+/* Follow the bytes the stub reads to find where packets start, and
+   name them: the command letter, with the rest of the word for
+   q, Q and v packets and the type for Z and z. */
+static void
+packet_byte (uint8_t c)
+{
+  if (c == '$')
+    {
+      packet_done ();
+      in_packet = timing = 1;
+      pkt_start = cpu.cycles;
+      pkt_name_len = 0;
+      pkt_name_done = 0;
+      pkt_name[0] = 0;
+      return;
+    }
+  if (c == 0x03 && !in_packet)
+    {
+      packet_done ();
+      stat_add ("^C", 0);
+      return;
+    }
+  if (!in_packet)
+    return;
+  if (c == '#')
+    {
+      in_packet = 0;
+      return;
+    }
+  if (pkt_name_done || pkt_name_len == NAME_LEN - 1)
+    return;
+
+  if (pkt_name_len == 0)
+    pkt_name_done = !strchr ("qQvZz", c);
+  else if (pkt_name[0] == 'Z' || pkt_name[0] == 'z')
+    pkt_name_done = 1;
+  else if (!(c >= 'a' && c <= 'z') && !(c >= 'A' && c <= 'Z') && c != '?')
+    {
+      pkt_name_done = 1;
+      return;
+    }
+  pkt_name[pkt_name_len++] = c;
+  pkt_name[pkt_name_len] = 0;
+}
+
+/* ---------- host side of the UART ---------- */
+
+static void
+host_closed (void)
+{
+  fprintf (stderr, "z80sim: gdb went away\n");
+  stats_report ();
+  if (!use_pty)
+    {
+      close (host_fd);
+      host_fd = -1;
+    }
+  rx_head = rx_tail = 0;
+  tx_len = 0;
+}
+
+static void
+tx_flush (void)
+{
+  unsigned int done = 0;
+  ssize_t n;
+
+  if (host_fd < 0)
+    {
+      tx_len = 0;
+      return;
+    }
+  while (done < tx_len)
+    {
+      n = write (host_fd, tx_buf + done, tx_len - done);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0 && errno == EAGAIN)
+        {
+          fd_set wfds;
+
+          FD_ZERO (&wfds);
+          FD_SET (host_fd, &wfds);
+          select (host_fd + 1, 0, &wfds, 0, 0);
+          continue;
+        }
+      if (n <= 0)
+        {
+          host_closed ();
+          return;
+        }
+      done += n;
+    }
+  tx_len = 0;
+}
+
+/* Take what the host sent.  With wait, block until there is something
+   (or a quit signal); otherwise only sleep a little once the line has
+   been quiet for a while, so an idle UART_RX_IRQ stub doesn't spin. */
+static void
+uart_poll (int wait)
+{
+  struct timeval tv, *timeout;
+  fd_set rfds;
+  uint8_t buf[512];
+  ssize_t n, i;
+  int fd;
+
+  tx_flush ();
+
+  for (;;)
+    {
+      fd = (host_fd >= 0) ? host_fd : listen_fd;
+      FD_ZERO (&rfds);
+      FD_SET (fd, &rfds);
+      tv.tv_sec = 0;
+      tv.tv_usec = (idle_polls > IDLE_POLLS) ? 1000 : 0;
+      timeout = wait ? 0 : &tv;
+      if (select (fd + 1, &rfds, 0, 0, timeout) <= 0)
+        {
+          idle_polls++;
+          return;
+        }
+
+      if (host_fd < 0)
+        {
+          host_fd = accept (listen_fd, 0, 0);
+          if (host_fd >= 0)
+            {
+              int one = 1;
+
+              setsockopt (host_fd, IPPROTO_TCP, TCP_NODELAY, &one,
+                          sizeof (one));
+              fprintf (stderr, "z80sim: gdb connected\n");
+            }
+          continue;
+        }
+
+      n = read (host_fd, buf, sizeof (buf));
+      if (n < 0 && (errno == EINTR || errno == EAGAIN))
+        return;
+      if (n <= 0)
+        {
+          host_closed ();
+          if (use_pty || !wait)
+            return;
+          continue;
+        }
+      if (rx_head == rx_tail && rx_ready_at < cpu.cycles + byte_time)
+        rx_ready_at = cpu.cycles + byte_time;
+      for (i = 0; i < n && ((rx_head + 1) % RX_SIZE) != rx_tail; i++)
+        {
+          rx_buf[rx_head] = buf[i];
+          rx_head = (rx_head + 1) % RX_SIZE;
+        }
+      bytes_in += n;
+      idle_polls = 0;
+      return;
+    }
+}
+
+/* Tell the -l log the stub is waiting, once per change. */
+static void
+log_idle (void)
+{
+  if (!idle_log || rx_head != rx_tail
+      || (rx_consumed == logged_consumed && tx_sent == logged_sent))
+    return;
+  fprintf (idle_log, "idle %llu %llu %llu\n", cpu.cycles, rx_consumed,
+           tx_sent);
+  fflush (idle_log);
+  logged_consumed = rx_consumed;
+  logged_sent = tx_sent;
+}
+
+/* Non zero if the byte at rx_tail has made it down the line */
+static int
+rx_ready (void)
+{
+  return rx_head != rx_tail && cpu.cycles >= rx_ready_at;
+}
+
+static uint8_t
+sim_in (void *user, uint16_t port)
+{
+  (void) user;
+  if ((port & 0xff) == bank_port)
+    return bank;
+  switch (port & 0xff)
+    {
+    case UART_DATA:
+      /* an empty read means the stub is waiting for gdb: no need to
+         run its polling loop, wait for the host here */
+      if (rx_head == rx_tail && !quit)
+        {
+          tx_flush ();
+          log_idle ();
+          uart_poll (1);
+        }
+      rx_valid = rx_ready ();
+      if (rx_valid)
+        {
+          rx_latch = rx_buf[rx_tail];
+          rx_tail = (rx_tail + 1) % RX_SIZE;
+          rx_ready_at += byte_time;
+          rx_consumed++;
+          packet_byte (rx_latch);
+        }
+      return rx_latch;
+    case UART_RX_VALID:
+      return rx_valid ? UART_RX_VALID_MASK : 0;
+    default:
+      return 0xff;
+    }
+}
+
+static void
+sim_out (void *user, uint16_t port, uint8_t value)
+{
+  (void) user;
+  if ((port & 0xff) == bank_port)
+    {
+      bank = value;
+      return;
+    }
+  switch (port & 0xff)
+    {
+    case UART_DATA:
+      tx_buf[tx_len++] = value;
+      bytes_out++;
+      tx_sent++;
+      last_tx = cpu.cycles;
+      if (tx_len == TX_SIZE)
+        tx_flush ();
+      break;
+    case NMI_FF_CLR:            /* NMIs are edges here, nothing to clear */
+    default:
+      break;
+    }
+}
+
+static uint8_t
+sim_read (void *user, uint16_t addr)
+{
+  (void) user;
+  if (bank_port >= 0 && addr >= BANK_WINDOW)
+    return banks[bank % BANK_COUNT][addr - BANK_WINDOW];
+  return mem[addr];
+}
+
+static void
+sim_write (void *user, uint16_t addr, uint8_t value)
+{
+  (void) user;
+  if (bank_port >= 0 && addr >= BANK_WINDOW)
+    banks[bank % BANK_COUNT][addr - BANK_WINDOW] = value;
+  else
+    mem[addr] = value;
+}
+
+/* ---------- setup ---------- */
+
+static int
+hexbyte (const char *p)
+{
+  unsigned int v;
+
+  if (sscanf (p, "%2x", &v) != 1)
+    return -1;
+  return v;
+}
+
+/* Load an Intel hex file into mem.  Return non zero on error. */
+static int
+load_hex (const char *file)
+{
+  char line[600];
+  FILE *f = fopen (file, "r");
+  int len, addr, type, i, b;
+
+  if (!f)
+    {
+      perror (file);
+      return 1;
+    }
+  while (fgets (line, sizeof (line), f))
+    {
+      if (line[0] != ':')
+        continue;
+      len = hexbyte (line + 1);
+      addr = (hexbyte (line + 3) << 8) | hexbyte (line + 5);
+      type = hexbyte (line + 7);
+      if (len < 0 || addr < 0 || type < 0)
+        break;
+      if (type == 1)
+        {
+          fclose (f);
+          return 0;
+        }
+      if (type != 0)
+        continue;
+      for (i = 0; i < len; i++)
+        {
+          b = hexbyte (line + 9 + 2 * i);
+          if (b < 0)
+            break;
+          mem[(addr + i) & 0xffff] = b;
+        }
+    }
+  i = ferror (f);
+  fclose (f);
+  return i;
+}
+
+static int
+open_tcp (int port)
+{
+  struct sockaddr_in sa;
+  int one = 1;
+
+  listen_fd = socket (AF_INET, SOCK_STREAM, 0);
+  if (listen_fd < 0)
+    return 1;
+  setsockopt (listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+  memset (&sa, 0, sizeof (sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  sa.sin_port = htons (port);
+  if (bind (listen_fd, (struct sockaddr *) &sa, sizeof (sa)) < 0
+      || listen (listen_fd, 1) < 0)
+    return 1;
+  fprintf (stderr, "z80sim: waiting for gdb on localhost:%d\n", port);
+  return 0;
+}
+
+static int
+open_pty (void)
+{
+  struct termios tio;
+  char *name;
+  int slave;
+
+  host_fd = posix_openpt (O_RDWR | O_NOCTTY);
+  if (host_fd < 0 || grantpt (host_fd) < 0 || unlockpt (host_fd) < 0)
+    return 1;
+  name = ptsname (host_fd);
+  if (!name)
+    return 1;
+
+  /* raw, and kept open so the master doesn't see hangups between
+     gdb sessions */
+  slave = open (name, O_RDWR | O_NOCTTY);
+  if (slave < 0 || tcgetattr (slave, &tio) < 0)
+    return 1;
+  cfmakeraw (&tio);
+  tcsetattr (slave, TCSANOW, &tio);
+  fprintf (stderr, "z80sim: gdb can use %s\n", name);
+  return 0;
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr,
+           "usage: z80sim [-t port | -p] [-n period] [-b baud] [-c clock]\n"
+           "              [-l file] [-k port] monitor.hex\n"
+           "  -t port    wait for gdb on localhost:port (default 2000)\n"
+           "  -p         use a pseudo terminal instead\n"
+           "  -n period  raise an NMI every period T-states\n"
+           "  -b baud    pace received bytes at baud (default unpaced)\n"
+           "  -c clock   CPU clock in Hz for -b (default 4000000)\n"
+           "  -l file    log when the stub waits for the host (- for stdout)\n"
+           "  -k port    16K RAM banks at 0xc000, selected by writing port\n");
+  exit (2);
+}
+
+int
+main (int argc, char **argv)
+{
+  unsigned long long nmi_period = 0, next_nmi = 0, next_poll = 0;
+  unsigned long baud = 0, clock = 4000000;
+  int port = 2000;
+  int opt;
+
+  while ((opt = getopt (argc, argv, "t:pn:b:c:l:k:")) != -1)
+    switch (opt)
+      {
+      case 't':
+        port = atoi (optarg);
+        break;
+      case 'p':
+        use_pty = 1;
+        break;
+      case 'n':
+        nmi_period = strtoull (optarg, 0, 0);
+        break;
+      case 'b':
+        baud = strtoul (optarg, 0, 0);
+        break;
+      case 'c':
+        clock = strtoul (optarg, 0, 0);
+        break;
+      case 'l':
+        idle_log = strcmp (optarg, "-") ? fopen (optarg, "w") : stdout;
+        if (!idle_log)
+          {
+            perror (optarg);
+            return 1;
+          }
+        break;
+      case 'k':
+        bank_port = strtol (optarg, 0, 0) & 0xff;
+        break;
+      default:
+        usage ();
+      }
+  if (optind != argc - 1)
+    usage ();
+  if (baud)
+    byte_time = 10ULL * clock / baud;
+
+  memset (mem, 0xff, sizeof (mem));
+  if (load_hex (argv[optind]))
+    {
+      fprintf (stderr, "z80sim: can't load %s\n", argv[optind]);
+      return 1;
+    }
+  if (use_pty ? open_pty () : open_tcp (port))
+    {
+      perror ("z80sim");
+      return 1;
+    }
+
+  signal (SIGINT, on_signal);
+  signal (SIGTERM, on_signal);
+  signal (SIGPIPE, SIG_IGN);
+
+  cpu.read = sim_read;
+  cpu.write = sim_write;
+  cpu.in = sim_in;
+  cpu.out = sim_out;
+  z80_reset (&cpu);
+  next_nmi = nmi_period;
+
+  while (!quit)
+    {
+      z80_step (&cpu);
+      if (nmi_period && cpu.cycles >= next_nmi)
+        {
+          z80_nmi (&cpu);
+          next_nmi += nmi_period;
+        }
+      if (cpu.cycles >= next_poll)
+        {
+          uart_poll (0);
+          next_poll = cpu.cycles + POLL_PERIOD;
+        }
+      cpu.int_line = rx_ready ();
+    }
+
+  tx_flush ();
+  stats_report ();
+  return 0;
+}
@@ -75,6 +75,15 @@
                                         where only part of the data was
                                         written).
 
+        write mem       XAA..AA,LLLL:BB..BB
+        (binary)                        AA..AA is address,
+                                        LLLL is number of bytes,
+                                        BB..BB is binary data, with '#',
+                                        '$', '}' and '*' escaped as '}'
+                                        followed by the byte XOR 0x20
+        reply           OK              for success
+                        ENN             for an error
+
         cont            cAA..AA         AA..AA is address to resume
                                         If AA..AA is omitted,
                                         resume at same address.
@@ -83,6 +92,26 @@
                                         If AA..AA is omitted,
                                         resume at same address.
 
+        resume          vCont;ACTION    ACTION is c, s, Cxx, Sxx or
+                                        rAA..AA,BB..BB: step while PC is in
+                                        [AA..AA, BB..BB), stepping done by
+                                        the stub.  Only the first action
+                                        is used (one thread).
+                        vCont?          Reply the supported actions.
+
+        lz4 write       vLZWrite:AA..AA,LLLL,CCCCCCCC:BB..BB
+                                        BB..BB is an LZ4 block (binary,
+                                        escaped as for X) that the stub
+                                        unpacks to AA..AA.  It must come
+                                        to LLLL bytes (not 0) with CRC-32
+                                        (as qCRC) CCCCCCCC, all below
+                                        0x10000 or in one bank.
+        reply           OK              for success
+                        E01             bad packet or address
+                        E02             CRC mismatch
+                        E03             wrong length
+                        <empty>         (an older stub), use X
+
         last signal     ?               Reply the current reason for stopping.
                                         This is the same reply as is generated
                                         for step or cont : SAA where AA is the
@@ -92,6 +121,10 @@
         The reply comes when the machine stops.
         It is           SAA             AA is the "signal number"
 
+        interrupt       ^C (0x03, not a packet) while the inferior runs
+                                        stops it with signal 2, only with
+                                        UART_RX_IRQ (else use the NMI).
+
         or...           TAAn...:r...;n:r...;n...:r...;
                                         AA = signal number
                                         n... = register number
@@ -115,7 +148,91 @@
                                         mask MM.  PP and MM are 4 bytes.
                                         Not supported by all stubs.
 
+        insert break    Z0,AA..AA,K[;XLL,EE..EE]...
+                                        Software breakpoint at AA..AA, the
+                                        stub patches it in while running.
+                                        Each ;X is an agent expression of
+                                        LL bytes, the stub only reports
+                                        the breakpoint if one is non zero.
+        remove break    z0,AA..AA,K
+        reply           OK              for success
+                        ENN             for an error (table full)
+
+        insert watch    ZT,AA..AA,LL    T is 2 (write), 3 (read) or 4
+                                        (access), LL bytes at AA..AA.
+                                        Continues turn into single steps
+                                        done by the stub, checking the
+                                        watched memory after each one.
+        remove watch    zT,AA..AA,LL
+        reply           OK              for success
+                        ENN             for an error
+
+        tracepoint      QTDP:n:AA..AA:E:SS:PP[-]
+                                        Define tracepoint n at AA..AA,
+                                        enabled (E) or disabled (D), PP is
+                                        the pass count.  SS (while-stepping)
+                                        is ignored.
+                        QTDP:-n:AA..AA:ACTION[-]
+                                        Add an action to tracepoint n:
+                                        Mbase,offset,len collects len bytes
+                                        at register base + offset (base -1
+                                        for absolute).  Registers are in
+                                        every frame, R and X are ignored.
+        reply           OK              for success
+                        ENN             for an error (table full)
+        trace control   QTinit          Forget tracepoints and trace data.
+                        QTStart         Start collecting, each tracepoint
+                                        hit saves a frame on the target and
+                                        the inferior goes on at once.
+                        QTStop          Stop collecting.
+        reply           OK
+        trace status    qTStatus
+        reply           T1 or T0;REASON, then ;tframes:, ;tcreated:,
+                                        ;tfree:, ;tsize: and ;circular:0
+        trace frame     QTFrame:n       Select frame n, g and m read from it,
+                                        G, M and X get E01.
+                        QTFrame:pc:AA..AA
+                        QTFrame:tdp:n   Next frame at PC AA..AA, or of
+                                        tracepoint n.
+        reply           FffffTnnnn      frame ffff of tracepoint nnnn
+                        F-1             no such frame
+                        OK              for QTFrame:ffffffff, back to
+                                        the live target
+
         general query   qXXXX           Request info about XXXX.
+        crc             qCRC:AA..AA,LLLL
+        reply           CXXXXXXXX       CRC-32 of LLLL bytes at AA..AA,
+                                        all below 0x10000 or in one bank
+                        or ENN          for an error.
+        block crcs      qCRCBlocks:AA..AA,LLLL,BBBB
+        reply           CXXXXXXXX...    CRC-32 of each BBBB byte block of
+                                        the LLLL bytes at AA..AA, the last
+                                        one short.  Fewer if the reply
+                                        would not fit or the bank ends,
+                                        ask again for the rest.
+                        or ENN          for an error.
+        search mem      qSearch:memory:AA..AA;LLLL;PP..PP
+                                        Look for the binary pattern PP..PP
+                                        in LLLL bytes from AA..AA, a bank
+                                        at a time.
+        reply           1,XXXXXXXX      found at address XXXXXXXX
+                        0               not found
+                        E01             bad packet or address
+        features        qSupported[:gdbfeatures]
+        reply           PacketSize=NNNN Largest packet (hex) the stub takes.
+                                        ;QStartNoAckMode+;swbreak+
+                                        ;ConditionalBreakpoints+
+                                        ;qXfer:memory-map:read+ with
+                                        BANKED_MEMORY
+        memory map      qXfer:memory-map:read::OFFSET,LENGTH
+        reply           mXX..XX         LENGTH bytes of the XML memory
+                                        map from OFFSET, more follow
+                        lXX..XX         the rest of it
+        With BANKED_MEMORY addresses in m, M and X can be above 0xffff,
+        bank n at 0x10000 + n * BANK_SIZE.  M and X reply E03 if some of
+        the address range does not exist.
+        no ack mode     QStartNoAckMode Stop sending and expecting +/- acks
+        reply           OK              acks stop once this is acked
         general set     QXXXX=yyyy      Set value of XXXX to yyyy.
         query sect offs qOffsets        Get section offsets.  Reply is
                                         Text=xxx;Data=yyy;Bss=zzz
@@ -127,6 +244,9 @@
         stands for that many repititions of the character preceding the '*'.
         The encoding is n+29, yielding a printable character where n >=3 
         (which is where rle starts to win).  Don't use an n > 126. 
+        Don't use the counts that encode as '#' or '$' (n of 6 and 7)
+        either; this stub also avoids '+' and '-', and splits longer
+        runs into several chunks.
 
         So 
         "0* " means the same as "0000".  */
@@ -154,6 +274,54 @@
 /* external NMI FF clear */
 #define NMI_FF_CLR         0x10
 
+/*
+ * With UART_RX_IRQ the UART is serviced from the IM 1 interrupt (RST 38)
+ * into a ring buffer, so characters arriving while the stub is busy
+ * building a reply are not lost.  RXBUF_SIZE must be a power of two.
+ * It also lets gdb's ^C stop a running inferior without the NMI button,
+ * as long as the inferior keeps interrupts enabled.
+ */
+#ifdef UART_RX_IRQ
+#ifndef TARGET_Z80
+#error UART_RX_IRQ needs the UART_RX_VALID port of TARGET_Z80
+#endif
+#define RXBUF_SIZE         64
+#define RXBUF_MASK         (RXBUF_SIZE - 1)
+#endif
+
+/*
+ * With BANKED_MEMORY, BANK_COUNT banks of BANK_SIZE bytes page into the
+ * window at BANK_WINDOW when their number is written to BANK_PORT, which
+ * must read back.  gdb sees bank n at BANKED_BASE + n * BANK_SIZE and
+ * the CPU's 64K, window as the inferior left it, below BANKED_BASE.
+ * qXfer:memory-map:read has the flat view below ROM_SIZE and the first
+ * BANK_ROM banks as ROM, the rest as RAM.
+ */
+#ifdef BANKED_MEMORY
+#ifndef BANK_PORT
+#define BANK_PORT          0x20
+#endif
+#ifndef BANK_WINDOW
+#define BANK_WINDOW        0xC000
+#endif
+#ifndef BANK_SIZE
+#define BANK_SIZE          0x4000
+#endif
+#ifndef BANK_COUNT
+#define BANK_COUNT         16
+#endif
+#ifndef BANK_ROM
+#define BANK_ROM           0
+#endif
+#ifndef ROM_SIZE
+#define ROM_SIZE           0x8000
+#endif
+#define BANKED_BASE        0x10000UL
+#endif
+
+/* RST 38 handler of the inferior, in RAM */
+#define USER_INT_VEC       0xB038
+
 /* Z80 instruction opcodes */
 #define RST08_INST     0xCF
 #define BREAK_INST     RST08_INST
@@ -162,8 +330,12 @@
 /*
  * BUFMAX defines the maximum number of characters in inbound/outbound
  * buffers. At least NUMREGBYTES*2 are needed for register packets.
+ * It is advertised to gdb as PacketSize, so bigger buffers mean fewer
+ * round trips for memory transfers.  Usually set from the Makefile.
  */
+#ifndef BUFMAX
 #define BUFMAX 256
+#endif
 
 /* Z80 registers (should match the constants used in gdb  */
 
@@ -190,6 +362,24 @@
 
 #define R_PC    24
 
+/* gdb register numbers (the order of the g packet), used to expedite
+   registers in T stop replies */
+#define REGNO_A    0
+#define REGNO_F    1
+#define REGNO_HL   4
+#define REGNO_SP   7
+#define REGNO_PC   15
+
+/*
+ * Run length encoding of replies: "X*c" stands for X followed by
+ * c - RLE_BIAS more copies of X.
+ */
+#define RLE_BIAS           29
+#define RLE_MIN_REPEAT     3                  /* ' ', less doesn't pay */
+#define RLE_MAX_REPEAT     ('~' - RLE_BIAS)   /* last printable count */
+#define RLE_BAD_REPEAT(n)  ((n) + RLE_BIAS == '#' || (n) + RLE_BIAS == '$' \
+                            || (n) + RLE_BIAS == '+' || (n) + RLE_BIAS == '-')
+
 /*
  * Number of bytes for registers
  */
@@ -199,14 +389,26 @@
  * Forward declarations
  */
 static int hex (char);
-static char *mem2hex (char *, char *, int);
+static char *mem2hex (char *, char *, int) __naked;
 static char *hex2mem (char *, char *, int);
 static int hexToInt (char **, int *);
+static int hexToLong (char **, unsigned long *);
+static char *mem_map (unsigned long, unsigned int *);
+static void mem_unmap (void);
+static int write_memory (unsigned long, char *, unsigned int, char);
+static char *word2hex (unsigned int, char *);
+static char *long2hex (unsigned long, char *);
+static unsigned long memcrc32 (char *, unsigned int) __naked;
+static unsigned int scanbyte (char *, unsigned int, char) __naked;
+static int search_memory (unsigned long, unsigned int, char *, unsigned int);
+static void crc_blocks (char *, unsigned int, unsigned int);
+static char *lz4_unpack (char *, unsigned int, char *) __naked;
 static char *getpacket (void);
 static void putpacket (char *);
 static int computeSignal (int exceptionVector);
 static void handle_exception (int exceptionVector);
 
+static char mem_operand (char *pc, char **addr, unsigned long *len);
 int handle_monitor_command(char *cmdstr);
 char read_port(char in_port) __naked;
 void write_port(char out_port, char out_data) __naked;
@@ -214,6 +416,7 @@ void write_port(char out_port, char out_data) __naked;
 void init_serial();
 
 void putDebugChar (char);
+void putDebugBuf (char *, int) __naked;
 char getDebugChar (void);
 
 char cc_holds(char cond);
@@ -231,18 +434,54 @@ void INIT ();
 #define MONITOR_STACK_BOTTOM  0xB000 // (MONITOR_STACK_SIZE + MONITOR_STACK)
 #define Z80_NMI               0x66
 #define Z80_RST08_VEC         8
+#define Z80_UART_BREAK        0x38      /* gdb's ^C, seen by uart_isr */
+#define Z80_NMI_EXIT          0x67      /* an NMI on rr's way out */
 
 short monitor_sp;
 
-char intcause; /* TODO: initialize */
-char in_nmi;   /* Set when handling an NMI, so we don't reenter */
+int intcause;  /* non zero from sr to rr, while the inferior is stopped */
+static unsigned int rr_tail;  /* where rr's exit goes: _rr_ei, _rr_di,
+                                 or _rr_nmi once nmi_entry latched one */
+int nmi_pending;  /* an NMI came in while the monitor ran, rr takes it;
+                    an int so rr's exit can clear it with hl alone */
 int dofault;   /* Non zero, bus errors will raise exception */
 
 char read_ch;  /* TODO: byte read from serial port, for now it's a global */
 
+#ifdef UART_RX_IRQ
+static volatile unsigned char rxbuf[RXBUF_SIZE];
+static volatile unsigned char rx_head;  /* written by uart_isr only */
+static volatile unsigned char rx_tail;  /* written by getDebugChar only */
+
+char inferior_iff;  /* flags after ld a,i in sr, P/V is the inferior's IFF2 */
+static volatile unsigned int rx_overruns;  /* characters dropped, ring full */
+#endif
+
+/* Counters for monitor stats, cleared by monitor stats reset.  Packets
+   from gdb are counted by command, STAT_TYPES and then all others. */
+#define STAT_TYPES      "?gGmMXcsvZzqQ"
+#define NSTAT_TYPES     (sizeof (STAT_TYPES) - 1)
+
+struct
+  {
+    unsigned long packetsIn;            /* good packets from gdb */
+    unsigned long packetsOut;           /* packets sent, not counting resends */
+    unsigned int badChecksums;          /* NAKed by getpacket */
+    unsigned int overlong;              /* dropped, too long for remcomInBuffer */
+    unsigned int retransmits;           /* resent by putpacket */
+    unsigned long entries;              /* times the monitor was entered */
+    unsigned long stops;                /* of which reported to gdb */
+    unsigned int byType[NSTAT_TYPES + 1];
+  }
+stubStats;
+
 /* debug > 0 prints ill-formed commands in valid packets & checksum errors */
 int remote_debug;
 
+/* Non zero once gdb negotiated QStartNoAckMode, +/- acks are neither
+   sent nor expected */
+char noack_mode;
+
 volatile struct {
   char a;
   char f;
@@ -270,9 +509,222 @@ stepData;
 
 stepData instrBuffer;
 char stepped;
+
+/* Software breakpoints set by gdb with Z0.  They are only patched into
+   memory while the inferior runs.  cond holds the agent expressions of
+   a conditional breakpoint, each one preceded by its length. */
+#define MAX_BREAKPOINTS 16
+#define BP_COND_MAX     32
+
+typedef struct
+  {
+    char *memAddr;
+    char oldInstr;
+    char inUse;
+    char inserted;
+    unsigned char condLen;
+    unsigned char cond[BP_COND_MAX];
+  }
+breakData;
+
+breakData breakTable[MAX_BREAKPOINTS];
+char breaksInserted;
+char breakHit;     /* the last stop was one of our breakpoints */
+char stepOver;     /* stepping past a breakpoint whose condition was false */
+
+/* Agent expression bytecodes (see the gdb manual) */
+#define AX_ADD            0x02
+#define AX_SUB            0x03
+#define AX_MUL            0x04
+#define AX_DIV_SIGNED     0x05
+#define AX_DIV_UNSIGNED   0x06
+#define AX_REM_SIGNED     0x07
+#define AX_REM_UNSIGNED   0x08
+#define AX_LSH            0x09
+#define AX_RSH_SIGNED     0x0a
+#define AX_RSH_UNSIGNED   0x0b
+#define AX_TRACE          0x0c
+#define AX_TRACE_QUICK    0x0d
+#define AX_LOG_NOT        0x0e
+#define AX_BIT_AND        0x0f
+#define AX_BIT_OR         0x10
+#define AX_BIT_XOR        0x11
+#define AX_BIT_NOT        0x12
+#define AX_EQUAL          0x13
+#define AX_LESS_SIGNED    0x14
+#define AX_LESS_UNSIGNED  0x15
+#define AX_EXT            0x16
+#define AX_REF8           0x17
+#define AX_REF16          0x18
+#define AX_REF32          0x19
+#define AX_IF_GOTO        0x20
+#define AX_GOTO           0x21
+#define AX_CONST8         0x22
+#define AX_CONST16        0x23
+#define AX_CONST32        0x24
+#define AX_CONST64        0x25
+#define AX_REG            0x26
+#define AX_END            0x27
+#define AX_DUP            0x28
+#define AX_POP            0x29
+#define AX_ZERO_EXT       0x2a
+#define AX_SWAP           0x2b
+#define AX_PICK           0x32
+#define AX_ROT            0x33
+
+/* values are 32 bits, plenty for a 16 bit target */
+#define AX_STACK_SIZE     16
+static long axStack[AX_STACK_SIZE];
+
+/* bytecodes run per evaluation, so a backward goto can't hang a stop */
+#define AX_MAX_STEPS      1000
+
+/* size of each register, in g packet order */
+#define NUMREGS 16
+static const unsigned char regSizes[NUMREGS] =
+  { 1, 1, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 2, 2, 2, 2 };
+
+/* Watchpoints set by gdb with Z2 (write), Z3 (read) and Z4 (access).
+   There is no debug hardware, so while any is set the stub single steps
+   the inferior itself and checks them after every instruction. */
+#define MAX_WATCHPOINTS 4
+#define WATCH_MAXLEN    4
+
+typedef struct
+  {
+    char *memAddr;
+    unsigned char len;
+    char type;          /* '2', '3' or '4', as in the Z packet */
+    char oldData[WATCH_MAXLEN];
+    char inUse;
+  }
+watchData;
+
+watchData watchTable[MAX_WATCHPOINTS];
+watchData *watchHit;    /* the watchpoint that triggered the last stop */
+char watchContinue;     /* gdb asked for a continue, we are stepping */
+
+/* memory accessed by the instruction being stepped, from mem_operand */
+#define MEM_RD  1
+#define MEM_WR  2
+#define MEM_MOVE 4      /* and writes accessLen bytes at accessDest */
+char accessKind;
+char *accessAddr;
+char *accessDest;
+unsigned long accessLen;  /* up to 65536, a whole ldir */
+
+/* vCont;r range stepping, the stub keeps stepping without telling gdb
+   while PC is in [rangeStart, rangeEnd) */
+char rangeStepping;
+unsigned short rangeStart;
+unsigned short rangeEnd;
+
+/* Tracepoints defined with QTDP.  While a trace runs they are patched
+   in like breakpoints, a hit appends a frame to traceBuf and the
+   inferior goes on without telling gdb. */
+#define MAX_TRACEPOINTS 8
+#define TP_MAX_MEM      4
+#ifndef TRACE_BUF_SIZE
+#define TRACE_BUF_SIZE  2048
+#endif
+
+typedef struct
+  {
+    signed char basereg;        /* -1 for an absolute address */
+    int offset;
+    unsigned int len;
+  }
+traceMem;
+
+typedef struct
+  {
+    unsigned int num;
+    char *memAddr;
+    char oldInstr;
+    char inUse;
+    char inserted;
+    char enabled;
+    unsigned int pass;          /* stop the trace after pass hits, 0 never */
+    unsigned int hits;
+    unsigned char nmem;
+    traceMem mem[TP_MAX_MEM];
+  }
+traceData;
+
+/* A frame in traceBuf is a header with the registers, then a traceBlock
+   and its bytes for every memory range collected. */
+typedef struct
+  {
+    unsigned int tpnum;
+    unsigned int size;          /* bytes after the header */
+    char regs[NUMREGBYTES];
+  }
+traceFrameHdr;
+
+typedef struct
+  {
+    unsigned int addr;
+    unsigned int len;
+  }
+traceBlock;
+
+/* why the last trace stopped, for qTStatus */
+#define TRACE_NOTRUN    0
+#define TRACE_STOPPED   1
+#define TRACE_FULL      2
+#define TRACE_PASS      3
+
+traceData traceTable[MAX_TRACEPOINTS];
+unsigned char traceBuf[TRACE_BUF_SIZE];
+unsigned int traceUsed;         /* bytes of traceBuf holding frames */
+unsigned int traceFrames;
+char tracing;                   /* between QTStart and QTStop */
+char traceStop;
+unsigned int traceStopTp;       /* tracepoint that used up its pass count */
+int traceFrame = -1;            /* frame selected with QTFrame, -1 for none */
+
+/* PC sampling profiler.  While profiling, an NMI (from a periodic timer
+   on the NMI line) only counts PC in profileHist and the inferior goes
+   on; PCs in [profileBase, profileBase + profileLast] fall in buckets
+   of 2^profileShift bytes, the others in profileOther. */
+#define PROFILE_BUCKETS 256
+
+char profiling;
+unsigned int profileHist[PROFILE_BUCKETS];
+unsigned int profileOther;
+unsigned long profileSamples;
+unsigned int profileBase;
+unsigned int profileLast;
+unsigned char profileShift;
 static const char hexchars[] = "0123456789abcdef";
+/* hex digit values indexed by character, -1 for non hex characters */
+static const signed char hexvals[256] =
+{
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+  -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
 static char remcomInBuffer[BUFMAX];
+static int remcomInCount;   /* characters in remcomInBuffer, binary data may hold nulls */
 static char remcomOutBuffer[BUFMAX];
+#ifdef BANKED_MEMORY
+/* four regions of "<memory type="ram" start="0x..." length="0x..."/>" */
+static char memoryMap[4 * 64 + 32];
+#endif
+static char remcomTxBuffer[BUFMAX + 4];   /* framed remcomOutBuffer, $...#cs */
 
 struct buffer
 {
@@ -441,6 +893,67 @@ const struct tab_elt opc_ind[] =
   { 0x00, 0x00, pe_dummy   , 1 }, // "?"                    
 };
 
+/* Flat opcode -> entry index versions of the tables above, so decoding
+   is one lookup instead of a scan of up to ~60 masked compares.  Made
+   by host/opcidx.py from the tables, "make check" checks they agree. */
+static const unsigned char opc_main_idx[256] =
+{
+   0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11,  4,  5,  6, 12,
+  13,  1, 14,  3,  4,  5,  6, 15, 16,  9, 17, 11,  4,  5,  6, 18,
+  19,  1, 20,  3,  4,  5,  6, 21, 19,  9, 22, 11,  4,  5,  6, 23,
+  19,  1, 24,  3,  4,  5,  6, 25, 19,  9, 26, 11,  4,  5,  6, 27,
+  29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+  29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+  29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+  29, 29, 29, 29, 29, 29, 28, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+  30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
+  30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
+  30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
+  30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
+  31, 32, 33, 34, 35, 36, 37, 38, 31, 39, 33, 40, 35, 41, 37, 38,
+  31, 32, 33, 42, 35, 36, 37, 38, 31, 43, 33, 44, 35, 45, 37, 38,
+  31, 32, 33, 46, 35, 36, 37, 38, 31, 47, 33, 48, 35, 49, 37, 38,
+  31, 32, 33, 50, 35, 36, 37, 38, 31, 51, 33, 52, 35, 53, 37, 38
+};
+static const unsigned char opc_ed_idx[256] =
+{
+  26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26,
+  26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26,
+  26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26,
+  26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26,
+   2,  5,  6,  7,  8,  9, 10, 11,  2,  5, 12, 13, 26, 14, 26, 15,
+   2,  5,  6,  7, 26, 26, 16, 17,  2,  5, 12, 13, 26, 26, 18, 19,
+   2,  5,  6,  7, 26, 26, 26, 20,  2,  5, 12, 13, 26, 26, 26, 21,
+   0,  3,  6,  7, 26, 26, 26, 26,  2,  5, 12, 13, 26, 26, 26, 26,
+  26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26,
+  26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26,
+  22, 22, 22, 22, 26, 26, 26, 26, 22, 22, 22, 22, 26, 26, 26, 26,
+  22, 22, 22, 22, 26, 26, 26, 26, 22, 22, 22, 22, 26, 26, 26, 26,
+  26, 26, 26, 23, 26, 24, 26, 26, 26, 26, 26, 26, 26, 24, 26, 26,
+  26, 26, 26, 26, 26, 24, 26, 26, 26, 26, 26, 26, 26, 24, 26, 26,
+  26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26,
+  26, 26, 26, 25, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26
+};
+static const unsigned char opc_ind_idx[256] =
+{
+  27, 27, 27, 27, 27, 27, 27, 27, 27,  9, 27, 27, 27, 27, 27, 27,
+  27, 27, 27, 27, 27, 27, 27, 27, 27,  9, 27, 27, 27, 27, 27, 27,
+  27,  3,  4,  6,  0,  1,  2, 27, 27,  8,  5,  7,  0,  1,  2, 27,
+  27, 27, 27, 27, 10, 11, 12, 27, 27,  9, 27, 27, 27, 27, 27, 27,
+  27, 27, 27, 27, 18, 18, 14, 27, 27, 27, 27, 27, 18, 18, 14, 27,
+  27, 27, 27, 27, 18, 18, 14, 27, 27, 27, 27, 27, 18, 18, 14, 27,
+  17, 17, 17, 17, 16, 16, 14, 17, 17, 17, 17, 17, 16, 16, 14, 17,
+  15, 15, 15, 15, 15, 15, 13, 15, 27, 27, 27, 27, 18, 18, 14, 27,
+  27, 27, 27, 27, 20, 20, 19, 27, 27, 27, 27, 27, 20, 20, 19, 27,
+  27, 27, 27, 27, 20, 20, 19, 27, 27, 27, 27, 27, 20, 20, 19, 27,
+  27, 27, 27, 27, 20, 20, 19, 27, 27, 27, 27, 27, 20, 20, 19, 27,
+  27, 27, 27, 27, 20, 20, 19, 27, 27, 27, 27, 27, 20, 20, 19, 27,
+  27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 23, 27, 27, 27, 27,
+  27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27,
+  27, 21, 27, 24, 27, 22, 27, 27, 27, 25, 27, 27, 27, 27, 27, 27,
+  27, 27, 27, 27, 27, 27, 27, 27, 27, 26, 27, 27, 27, 27, 27, 27
+};
+
 void
 INIT (void)
 {
@@ -467,7 +980,7 @@ RESET (void) __naked
   reset_hook ();
 #endif
 
-  in_nmi = 0;
+  nmi_pending = 0;
   dofault = 1;
   stepped = 0;
 
@@ -477,12 +990,12 @@ RESET (void) __naked
     ;
 }
 
-char highhex(int  x)
+char highhex(unsigned char x)
 {
-  return hexchars[(x >> 4) & 0xf];
+  return hexchars[x >> 4];
 }
 
-char lowhex(int  x)
+char lowhex(unsigned char x)
 {
   return hexchars[x & 0xf];
 }
@@ -493,30 +1006,76 @@ char lowhex(int  x)
 static int
 hex (char ch)
 {
-  if ((ch >= 'a') && (ch <= 'f'))
-    return (ch - 'a' + 10);
-  if ((ch >= '0') && (ch <= '9'))
-    return (ch - '0');
-  if ((ch >= 'A') && (ch <= 'F'))
-    return (ch - 'A' + 10);
-  return (-1);
+  return hexvals[(unsigned char) ch];
 }
 
 /* convert the memory, pointed to by mem into hex, placing result in buf */
 /* return a pointer to the last char put in buf (null) */
+
+/* Each nibble is turned into its digit with the add/daa/adc/daa
+   trick, which needs no table lookup and no 16-bit arithmetic, for
+   about 160 T-states per byte.  The final 'or' maps 'A'-'F' to
+   lowercase and leaves '0'-'9' alone. */
 static char *
-mem2hex (char *mem, char *buf, int count)
+mem2hex (char *mem, char *buf, int count) __naked
 {
-  int i;
-  int ch;
-  for (i = 0; i < count; i++)
-    {
-      ch = *mem++;
-      *buf++ = highhex (ch);
-      *buf++ = lowhex (ch);
-    }
-  *buf = 0;
-  return (buf);
+  __asm
+    push ix
+    ld   ix, #0
+    add  ix, sp
+
+    ld   l, 4 (ix)          ;; hl = mem
+    ld   h, 5 (ix)
+    ld   e, 6 (ix)          ;; de = buf
+    ld   d, 7 (ix)
+    ld   c, 8 (ix)          ;; bc = count
+    ld   b, 9 (ix)
+
+    bit  7, b               ;; nothing to do for count <= 0
+    jr   nz, 0002$
+    ld   a, b
+    or   c
+    jr   z, 0002$
+
+0001$:
+    ld   a, (hl)            ;; high nibble
+    rrca
+    rrca
+    rrca
+    rrca
+    and  #0x0f
+    add  a, #0x90
+    daa
+    adc  a, #0x40
+    daa
+    or   #0x20
+    ld   (de), a
+    inc  de
+
+    ld   a, (hl)            ;; low nibble
+    and  #0x0f
+    add  a, #0x90
+    daa
+    adc  a, #0x40
+    daa
+    or   #0x20
+    ld   (de), a
+    inc  de
+
+    inc  hl
+    dec  bc
+    ld   a, b
+    or   c
+    jr   nz, 0001$
+
+0002$:
+    xor  a                  ;; null terminate buf
+    ld   (de), a
+    ex   de, hl             ;; and return a pointer to the null
+
+    pop  ix
+    ret
+  __endasm;
 }
 
 /* convert the hex array pointed to by buf into binary, to be placed in mem */
@@ -525,12 +1084,13 @@ mem2hex (char *mem, char *buf, int count)
 static char *
 hex2mem (char *buf, char *mem, int count)
 {
-  int i;
+  unsigned char *src = (unsigned char *) buf;
   unsigned char ch;
-  for (i = 0; i < count; i++)
+
+  while (count-- > 0)
     {
-      ch = hex (*buf++) << 4;
-      ch = ch + hex (*buf++);
+      ch = hexvals[*src++] << 4;
+      ch = ch | hexvals[*src++];
       *mem++ = ch;
     }
   return (mem);
@@ -544,25 +1104,564 @@ static int
 hexToInt (char **ptr, int *intValue)
 {
   int numChars = 0;
-  int hexValue;
+  signed char hexValue;
 
   *intValue = 0;
 
-  while (**ptr)
+  /* the terminating null is not a hex digit either */
+  while ((hexValue = hexvals[(unsigned char) **ptr]) >= 0)
+    {
+      *intValue = (*intValue << 4) | hexValue;
+      numChars++;
+      (*ptr)++;
+    }
+
+  return (numChars);
+}
+
+/* hexToInt for the 32 bit values, CRCs */
+static int
+hexToLong (char **ptr, unsigned long *longValue)
+{
+  int numChars = 0;
+  signed char hexValue;
+
+  *longValue = 0;
+
+  while ((hexValue = hexvals[(unsigned char) **ptr]) >= 0)
+    {
+      *longValue = (*longValue << 4) | hexValue;
+      numChars++;
+      (*ptr)++;
+    }
+
+  return (numChars);
+}
+
+/* A register or trace frame number, or -1 for none: gdb sends that as
+   ffffffff, or as -1.  Return 0 if there is none or it is out of range. */
+static int
+hexToIndex (char **ptr, int *intValue)
+{
+  unsigned long value;
+
+  if ((*ptr)[0] == '-' && (*ptr)[1] == '1'
+      && hexvals[(unsigned char) (*ptr)[2]] < 0)
+    {
+      *ptr += 2;
+      *intValue = -1;
+      return 1;
+    }
+  if (!hexToLong (ptr, &value))
+    return 0;
+  if (value == 0xffffffffUL)
+    *intValue = -1;
+  else if (value <= 0x7fff)
+    *intValue = value;
+  else
+    return 0;
+  return 1;
+}
+
+/* write value as four hex digits into buf */
+/* return a pointer to the last char put in buf (null) */
+static char *
+word2hex (unsigned int value, char *buf)
+{
+  *buf++ = highhex (value >> 8);
+  *buf++ = lowhex (value >> 8);
+  *buf++ = highhex (value);
+  *buf++ = lowhex (value);
+  *buf = 0;
+  return (buf);
+}
+
+/* write value as eight hex digits into buf */
+/* return a pointer to the last char put in buf (null) */
+static char *
+long2hex (unsigned long value, char *buf)
+{
+  buf = word2hex (value >> 16, buf);
+  return (word2hex (value, buf));
+}
+
+#ifdef BANKED_MEMORY
+static unsigned char savedBank;  /* the inferior's bank, while mem_map switched */
+static char bankSwitched;
+#endif
+
+/* The CPU address of the gdb address addr, 0 if there is no such
+   memory.  *len is cut down to the bytes that follow it there, up to
+   the end of the bank or of the 64K.  A banked address pages its bank
+   in, mem_unmap gives the inferior its own back. */
+static char *
+mem_map (unsigned long addr, unsigned int *len)
+{
+#ifdef BANKED_MEMORY
+  unsigned int offset;
+
+  if (addr >= BANKED_BASE)
+    {
+      addr -= BANKED_BASE;
+      if (addr >= (unsigned long) BANK_COUNT * BANK_SIZE)
+        return 0;
+      offset = (unsigned int) addr & (BANK_SIZE - 1);
+      if (*len > BANK_SIZE - offset)
+        *len = BANK_SIZE - offset;
+      if (!bankSwitched)
+        {
+          savedBank = read_port (BANK_PORT);
+          bankSwitched = 1;
+        }
+      write_port (BANK_PORT, addr / BANK_SIZE);
+      return (char *) (BANK_WINDOW + offset);
+    }
+#endif
+  if (addr > 0xffff)
+    return 0;
+  if (*len > 0x10000UL - addr)
+    *len = 0x10000UL - addr;
+  return (char *) (unsigned int) addr;
+}
+
+static void
+mem_unmap (void)
+{
+#ifdef BANKED_MEMORY
+  if (bankSwitched)
+    write_port (BANK_PORT, savedBank);
+  bankSwitched = 0;
+#endif
+}
+
+/* M and X: len bytes from src, hex digits unless binary, to the gdb
+   address addr, a bank at a time.  Return 0 if some had nowhere to go. */
+static int
+write_memory (unsigned long addr, char *src, unsigned int len, char binary)
+{
+  unsigned int part;
+  char *mem;
+
+  while (len)
     {
-      hexValue = hex (**ptr);
-      if (hexValue >= 0)
+      part = len;
+      mem = mem_map (addr, &part);
+      if (!mem)
+        break;
+      if (binary)
         {
-          *intValue = (*intValue << 4) | hexValue;
-          numChars++;
+          memcpy (mem, src, part);
+          src += part;
         }
       else
+        {
+          hex2mem (src, mem, part);
+          src += 2 * part;
+        }
+      addr += part;
+      len -= part;
+    }
+  mem_unmap ();
+  return (len == 0);
+}
+
+#ifdef BANKED_MEMORY
+/* append a region to the memory map at buf, return its end */
+static char *
+map_region (char *buf, char *type, unsigned long start, unsigned long length)
+{
+  strcpy (buf, "<memory type=\"");
+  strcat (buf, type);
+  strcat (buf, "\" start=\"0x");
+  buf = long2hex (start, buf + strlen (buf));
+  strcpy (buf, "\" length=\"0x");
+  buf = long2hex (length, buf + strlen (buf));
+  strcpy (buf, "\"/>");
+  return (buf + strlen (buf));
+}
+
+/* the qXfer:memory-map:read document, in memoryMap */
+static void
+memory_map (void)
+{
+  char *buf = memoryMap;
+
+  strcpy (buf, "<memory-map>");
+  buf += strlen (buf);
+  if (ROM_SIZE)
+    buf = map_region (buf, "rom", 0, ROM_SIZE);
+  buf = map_region (buf, "ram", ROM_SIZE, 0x10000UL - ROM_SIZE);
+  if (BANK_ROM)
+    buf = map_region (buf, "rom", BANKED_BASE,
+                      (unsigned long) BANK_ROM * BANK_SIZE);
+  if (BANK_COUNT > BANK_ROM)
+    buf = map_region (buf, "ram",
+                      BANKED_BASE + (unsigned long) BANK_ROM * BANK_SIZE,
+                      (unsigned long) (BANK_COUNT - BANK_ROM) * BANK_SIZE);
+  strcpy (buf, "</memory-map>");
+}
+#endif
+
+/* CRC-32 table for memcrc32, polynomial 0x04c11db7, msb first.  Split
+   in four planes of 256 bytes, most significant byte of each entry
+   first, so the byte for plane n is table + index + 256*n. */
+static const unsigned char crc32_table[4][256] =
+{
+  {
+    0x00, 0x04, 0x09, 0x0d, 0x13, 0x17, 0x1a, 0x1e, 0x26, 0x22, 0x2f, 0x2b, 0x35, 0x31, 0x3c, 0x38,
+    0x4c, 0x48, 0x45, 0x41, 0x5f, 0x5b, 0x56, 0x52, 0x6a, 0x6e, 0x63, 0x67, 0x79, 0x7d, 0x70, 0x74,
+    0x98, 0x9c, 0x91, 0x95, 0x8b, 0x8f, 0x82, 0x86, 0xbe, 0xba, 0xb7, 0xb3, 0xad, 0xa9, 0xa4, 0xa0,
+    0xd4, 0xd0, 0xdd, 0xd9, 0xc7, 0xc3, 0xce, 0xca, 0xf2, 0xf6, 0xfb, 0xff, 0xe1, 0xe5, 0xe8, 0xec,
+    0x34, 0x30, 0x3d, 0x39, 0x27, 0x23, 0x2e, 0x2a, 0x12, 0x16, 0x1b, 0x1f, 0x01, 0x05, 0x08, 0x0c,
+    0x78, 0x7c, 0x71, 0x75, 0x6b, 0x6f, 0x62, 0x66, 0x5e, 0x5a, 0x57, 0x53, 0x4d, 0x49, 0x44, 0x40,
+    0xac, 0xa8, 0xa5, 0xa1, 0xbf, 0xbb, 0xb6, 0xb2, 0x8a, 0x8e, 0x83, 0x87, 0x99, 0x9d, 0x90, 0x94,
+    0xe0, 0xe4, 0xe9, 0xed, 0xf3, 0xf7, 0xfa, 0xfe, 0xc6, 0xc2, 0xcf, 0xcb, 0xd5, 0xd1, 0xdc, 0xd8,
+    0x69, 0x6d, 0x60, 0x64, 0x7a, 0x7e, 0x73, 0x77, 0x4f, 0x4b, 0x46, 0x42, 0x5c, 0x58, 0x55, 0x51,
+    0x25, 0x21, 0x2c, 0x28, 0x36, 0x32, 0x3f, 0x3b, 0x03, 0x07, 0x0a, 0x0e, 0x10, 0x14, 0x19, 0x1d,
+    0xf1, 0xf5, 0xf8, 0xfc, 0xe2, 0xe6, 0xeb, 0xef, 0xd7, 0xd3, 0xde, 0xda, 0xc4, 0xc0, 0xcd, 0xc9,
+    0xbd, 0xb9, 0xb4, 0xb0, 0xae, 0xaa, 0xa7, 0xa3, 0x9b, 0x9f, 0x92, 0x96, 0x88, 0x8c, 0x81, 0x85,
+    0x5d, 0x59, 0x54, 0x50, 0x4e, 0x4a, 0x47, 0x43, 0x7b, 0x7f, 0x72, 0x76, 0x68, 0x6c, 0x61, 0x65,
+    0x11, 0x15, 0x18, 0x1c, 0x02, 0x06, 0x0b, 0x0f, 0x37, 0x33, 0x3e, 0x3a, 0x24, 0x20, 0x2d, 0x29,
+    0xc5, 0xc1, 0xcc, 0xc8, 0xd6, 0xd2, 0xdf, 0xdb, 0xe3, 0xe7, 0xea, 0xee, 0xf0, 0xf4, 0xf9, 0xfd,
+    0x89, 0x8d, 0x80, 0x84, 0x9a, 0x9e, 0x93, 0x97, 0xaf, 0xab, 0xa6, 0xa2, 0xbc, 0xb8, 0xb5, 0xb1
+  },
+  {
+    0x00, 0xc1, 0x82, 0x43, 0x04, 0xc5, 0x86, 0x47, 0x08, 0xc9, 0x8a, 0x4b, 0x0c, 0xcd, 0x8e, 0x4f,
+    0x11, 0xd0, 0x93, 0x52, 0x15, 0xd4, 0x97, 0x56, 0x19, 0xd8, 0x9b, 0x5a, 0x1d, 0xdc, 0x9f, 0x5e,
+    0x23, 0xe2, 0xa1, 0x60, 0x27, 0xe6, 0xa5, 0x64, 0x2b, 0xea, 0xa9, 0x68, 0x2f, 0xee, 0xad, 0x6c,
+    0x32, 0xf3, 0xb0, 0x71, 0x36, 0xf7, 0xb4, 0x75, 0x3a, 0xfb, 0xb8, 0x79, 0x3e, 0xff, 0xbc, 0x7d,
+    0x86, 0x47, 0x04, 0xc5, 0x82, 0x43, 0x00, 0xc1, 0x8e, 0x4f, 0x0c, 0xcd, 0x8a, 0x4b, 0x08, 0xc9,
+    0x97, 0x56, 0x15, 0xd4, 0x93, 0x52, 0x11, 0xd0, 0x9f, 0x5e, 0x1d, 0xdc, 0x9b, 0x5a, 0x19, 0xd8,
+    0xa5, 0x64, 0x27, 0xe6, 0xa1, 0x60, 0x23, 0xe2, 0xad, 0x6c, 0x2f, 0xee, 0xa9, 0x68, 0x2b, 0xea,
+    0xb4, 0x75, 0x36, 0xf7, 0xb0, 0x71, 0x32, 0xf3, 0xbc, 0x7d, 0x3e, 0xff, 0xb8, 0x79, 0x3a, 0xfb,
+    0x0c, 0xcd, 0x8e, 0x4f, 0x08, 0xc9, 0x8a, 0x4b, 0x04, 0xc5, 0x86, 0x47, 0x00, 0xc1, 0x82, 0x43,
+    0x1d, 0xdc, 0x9f, 0x5e, 0x19, 0xd8, 0x9b, 0x5a, 0x15, 0xd4, 0x97, 0x56, 0x11, 0xd0, 0x93, 0x52,
+    0x2f, 0xee, 0xad, 0x6c, 0x2b, 0xea, 0xa9, 0x68, 0x27, 0xe6, 0xa5, 0x64, 0x23, 0xe2, 0xa1, 0x60,
+    0x3e, 0xff, 0xbc, 0x7d, 0x3a, 0xfb, 0xb8, 0x79, 0x36, 0xf7, 0xb4, 0x75, 0x32, 0xf3, 0xb0, 0x71,
+    0x8a, 0x4b, 0x08, 0xc9, 0x8e, 0x4f, 0x0c, 0xcd, 0x82, 0x43, 0x00, 0xc1, 0x86, 0x47, 0x04, 0xc5,
+    0x9b, 0x5a, 0x19, 0xd8, 0x9f, 0x5e, 0x1d, 0xdc, 0x93, 0x52, 0x11, 0xd0, 0x97, 0x56, 0x15, 0xd4,
+    0xa9, 0x68, 0x2b, 0xea, 0xad, 0x6c, 0x2f, 0xee, 0xa1, 0x60, 0x23, 0xe2, 0xa5, 0x64, 0x27, 0xe6,
+    0xb8, 0x79, 0x3a, 0xfb, 0xbc, 0x7d, 0x3e, 0xff, 0xb0, 0x71, 0x32, 0xf3, 0xb4, 0x75, 0x36, 0xf7
+  },
+  {
+    0x00, 0x1d, 0x3b, 0x26, 0x76, 0x6b, 0x4d, 0x50, 0xed, 0xf0, 0xd6, 0xcb, 0x9b, 0x86, 0xa0, 0xbd,
+    0xdb, 0xc6, 0xe0, 0xfd, 0xad, 0xb0, 0x96, 0x8b, 0x36, 0x2b, 0x0d, 0x10, 0x40, 0x5d, 0x7b, 0x66,
+    0xb6, 0xab, 0x8d, 0x90, 0xc0, 0xdd, 0xfb, 0xe6, 0x5b, 0x46, 0x60, 0x7d, 0x2d, 0x30, 0x16, 0x0b,
+    0x6d, 0x70, 0x56, 0x4b, 0x1b, 0x06, 0x20, 0x3d, 0x80, 0x9d, 0xbb, 0xa6, 0xf6, 0xeb, 0xcd, 0xd0,
+    0x70, 0x6d, 0x4b, 0x56, 0x06, 0x1b, 0x3d, 0x20, 0x9d, 0x80, 0xa6, 0xbb, 0xeb, 0xf6, 0xd0, 0xcd,
+    0xab, 0xb6, 0x90, 0x8d, 0xdd, 0xc0, 0xe6, 0xfb, 0x46, 0x5b, 0x7d, 0x60, 0x30, 0x2d, 0x0b, 0x16,
+    0xc6, 0xdb, 0xfd, 0xe0, 0xb0, 0xad, 0x8b, 0x96, 0x2b, 0x36, 0x10, 0x0d, 0x5d, 0x40, 0x66, 0x7b,
+    0x1d, 0x00, 0x26, 0x3b, 0x6b, 0x76, 0x50, 0x4d, 0xf0, 0xed, 0xcb, 0xd6, 0x86, 0x9b, 0xbd, 0xa0,
+    0xe0, 0xfd, 0xdb, 0xc6, 0x96, 0x8b, 0xad, 0xb0, 0x0d, 0x10, 0x36, 0x2b, 0x7b, 0x66, 0x40, 0x5d,
+    0x3b, 0x26, 0x00, 0x1d, 0x4d, 0x50, 0x76, 0x6b, 0xd6, 0xcb, 0xed, 0xf0, 0xa0, 0xbd, 0x9b, 0x86,
+    0x56, 0x4b, 0x6d, 0x70, 0x20, 0x3d, 0x1b, 0x06, 0xbb, 0xa6, 0x80, 0x9d, 0xcd, 0xd0, 0xf6, 0xeb,
+    0x8d, 0x90, 0xb6, 0xab, 0xfb, 0xe6, 0xc0, 0xdd, 0x60, 0x7d, 0x5b, 0x46, 0x16, 0x0b, 0x2d, 0x30,
+    0x90, 0x8d, 0xab, 0xb6, 0xe6, 0xfb, 0xdd, 0xc0, 0x7d, 0x60, 0x46, 0x5b, 0x0b, 0x16, 0x30, 0x2d,
+    0x4b, 0x56, 0x70, 0x6d, 0x3d, 0x20, 0x06, 0x1b, 0xa6, 0xbb, 0x9d, 0x80, 0xd0, 0xcd, 0xeb, 0xf6,
+    0x26, 0x3b, 0x1d, 0x00, 0x50, 0x4d, 0x6b, 0x76, 0xcb, 0xd6, 0xf0, 0xed, 0xbd, 0xa0, 0x86, 0x9b,
+    0xfd, 0xe0, 0xc6, 0xdb, 0x8b, 0x96, 0xb0, 0xad, 0x10, 0x0d, 0x2b, 0x36, 0x66, 0x7b, 0x5d, 0x40
+  },
+  {
+    0x00, 0xb7, 0x6e, 0xd9, 0xdc, 0x6b, 0xb2, 0x05, 0xb8, 0x0f, 0xd6, 0x61, 0x64, 0xd3, 0x0a, 0xbd,
+    0x70, 0xc7, 0x1e, 0xa9, 0xac, 0x1b, 0xc2, 0x75, 0xc8, 0x7f, 0xa6, 0x11, 0x14, 0xa3, 0x7a, 0xcd,
+    0xe0, 0x57, 0x8e, 0x39, 0x3c, 0x8b, 0x52, 0xe5, 0x58, 0xef, 0x36, 0x81, 0x84, 0x33, 0xea, 0x5d,
+    0x90, 0x27, 0xfe, 0x49, 0x4c, 0xfb, 0x22, 0x95, 0x28, 0x9f, 0x46, 0xf1, 0xf4, 0x43, 0x9a, 0x2d,
+    0x77, 0xc0, 0x19, 0xae, 0xab, 0x1c, 0xc5, 0x72, 0xcf, 0x78, 0xa1, 0x16, 0x13, 0xa4, 0x7d, 0xca,
+    0x07, 0xb0, 0x69, 0xde, 0xdb, 0x6c, 0xb5, 0x02, 0xbf, 0x08, 0xd1, 0x66, 0x63, 0xd4, 0x0d, 0xba,
+    0x97, 0x20, 0xf9, 0x4e, 0x4b, 0xfc, 0x25, 0x92, 0x2f, 0x98, 0x41, 0xf6, 0xf3, 0x44, 0x9d, 0x2a,
+    0xe7, 0x50, 0x89, 0x3e, 0x3b, 0x8c, 0x55, 0xe2, 0x5f, 0xe8, 0x31, 0x86, 0x83, 0x34, 0xed, 0x5a,
+    0xee, 0x59, 0x80, 0x37, 0x32, 0x85, 0x5c, 0xeb, 0x56, 0xe1, 0x38, 0x8f, 0x8a, 0x3d, 0xe4, 0x53,
+    0x9e, 0x29, 0xf0, 0x47, 0x42, 0xf5, 0x2c, 0x9b, 0x26, 0x91, 0x48, 0xff, 0xfa, 0x4d, 0x94, 0x23,
+    0x0e, 0xb9, 0x60, 0xd7, 0xd2, 0x65, 0xbc, 0x0b, 0xb6, 0x01, 0xd8, 0x6f, 0x6a, 0xdd, 0x04, 0xb3,
+    0x7e, 0xc9, 0x10, 0xa7, 0xa2, 0x15, 0xcc, 0x7b, 0xc6, 0x71, 0xa8, 0x1f, 0x1a, 0xad, 0x74, 0xc3,
+    0x99, 0x2e, 0xf7, 0x40, 0x45, 0xf2, 0x2b, 0x9c, 0x21, 0x96, 0x4f, 0xf8, 0xfd, 0x4a, 0x93, 0x24,
+    0xe9, 0x5e, 0x87, 0x30, 0x35, 0x82, 0x5b, 0xec, 0x51, 0xe6, 0x3f, 0x88, 0x8d, 0x3a, 0xe3, 0x54,
+    0x79, 0xce, 0x17, 0xa0, 0xa5, 0x12, 0xcb, 0x7c, 0xc1, 0x76, 0xaf, 0x18, 0x1d, 0xaa, 0x73, 0xc4,
+    0x09, 0xbe, 0x67, 0xd0, 0xd5, 0x62, 0xbb, 0x0c, 0xb1, 0x06, 0xdf, 0x68, 0x6d, 0xda, 0x03, 0xb4
+  }
+};
+
+/* CRC-32 of count bytes at mem, as gdb computes it for qCRC: starts
+   from 0xffffffff, no final inversion.  The crc lives in b:c:d:e (msb
+   in b), so each byte is just three xors against the table planes. */
+static unsigned long
+memcrc32 (char *mem, unsigned int count) __naked
+{
+  __asm
+    push ix
+    ld   ix, #0
+    add  ix, sp
+
+    ld   e, 4 (ix)          ;; de = mem
+    ld   d, 5 (ix)
+    ld   l, 6 (ix)          ;; hl = count
+    ld   h, 7 (ix)
+    push de                 ;; ix walks mem from here on
+    pop  ix
+
+    ld   bc, #0xffff        ;; crc = 0xffffffff
+    ld   d, b
+    ld   e, c
+
+    ld   a, h
+    or   l
+    jr   z, 0002$
+    push hl                 ;; the count lives on the stack
+
+0001$:
+    ld   a, (ix)
+    inc  ix
+    xor  b                  ;; index = (crc >> 24) ^ byte
+    add  a, #<(_crc32_table)
+    ld   l, a
+    ld   a, #>(_crc32_table)
+    adc  a, #0
+    ld   h, a
+
+    ld   a, c               ;; crc = (crc << 8) ^ table[index]
+    xor  (hl)
+    ld   b, a
+    inc  h
+    ld   a, d
+    xor  (hl)
+    ld   c, a
+    inc  h
+    ld   a, e
+    xor  (hl)
+    ld   d, a
+    inc  h
+    ld   e, (hl)
+
+    ex   (sp), hl
+    dec  hl
+    ld   a, h
+    or   l
+    ex   (sp), hl
+    jr   nz, 0001$
+
+    pop  hl
+0002$:
+    ld   l, e               ;; return it in dehl
+    ld   h, d
+    ld   e, c
+    ld   d, b
+
+    pop  ix
+    ret
+  __endasm;
+}
+
+/* Look for value in the count bytes at mem with cpir.  Return how
+   many bytes are left from the first match to the end of the range,
+   match included, or 0 if there is none. */
+static unsigned int
+scanbyte (char *mem, unsigned int count, char value) __naked
+{
+  __asm
+    push ix
+    ld   ix, #0
+    add  ix, sp
+
+    ld   l, 4 (ix)          ;; hl = mem
+    ld   h, 5 (ix)
+    ld   c, 6 (ix)          ;; bc = count
+    ld   b, 7 (ix)
+
+    ld   a, b               ;; cpir would take bc = 0 as 64K
+    or   c
+    jr   z, 0001$
+
+    ld   a, 8 (ix)
+    cpir
+    jr   nz, 0001$
+
+    ld   l, c               ;; bc counts the bytes after the match
+    ld   h, b
+    inc  hl
+    pop  ix
+    ret
+
+0001$:
+    ld   hl, #0
+    pop  ix
+    ret
+  __endasm;
+}
+
+/* qSearch:memory, look for the patlen bytes of pattern in the len
+   bytes at the gdb address addr and leave the reply in remcomOutBuffer.
+   A bank at a time, so a match across the end of a bank is missed.
+   Return 0 if some of the range is not there. */
+static int
+search_memory (unsigned long addr, unsigned int len, char *pattern,
+               unsigned int patlen)
+{
+  unsigned int left, part, scan;
+  char *mem, *start;
+
+  strcpy (remcomOutBuffer, "0");
+  if (patlen == 0 || patlen > len)
+    return 1;
+
+  while (len)
+    {
+      part = len;
+      start = mem = mem_map (addr, &part);
+      if (!mem)
         break;
 
-      (*ptr)++;
+      /* only the first part - patlen + 1 bytes can start a match */
+      scan = (part >= patlen) ? part - patlen + 1 : 0;
+      while (scan && (left = scanbyte (mem, scan, pattern[0])) != 0)
+        {
+          mem += scan - left;
+          if (!memcmp (mem, pattern, patlen))
+            {
+              strcpy (remcomOutBuffer, "1,");
+              long2hex (addr + (mem - start), remcomOutBuffer + 2);
+              mem_unmap ();
+              return 1;
+            }
+          mem++;
+          scan = left - 1;
+        }
+      addr += part;
+      len -= part;
     }
+  mem_unmap ();
+  return (len == 0);
+}
 
-  return (numChars);
+/* qCRCBlocks, the CRC-32 of each block bytes in the len bytes at mem
+   (the last block may be short) into remcomOutBuffer, as many as fit */
+static void
+crc_blocks (char *mem, unsigned int len, unsigned int block)
+{
+  char *buf = remcomOutBuffer;
+
+  *buf++ = 'C';
+  *buf = 0;
+  while (len && buf + 8 < remcomOutBuffer + BUFMAX)
+    {
+      if (block > len)
+        block = len;
+      buf = long2hex (memcrc32 (mem, block), buf);
+      mem += block;
+      len -= block;
+    }
+}
+
+/* Unpack the LZ4 block of len bytes at src to dst, return the end of
+   the output, or dst if the block runs past len bytes or ends in a
+   match.  Literals and matches both go with ldir, which copies a byte
+   at a time, so a match overlapping its own output repeats as LZ4
+   wants.  Offsets and lengths are trusted: the caller checks the
+   result against the expected length and CRC. */
+static char *
+lz4_unpack (char *src, unsigned int len, char *dst) __naked
+{
+  __asm
+    push ix
+    ld   ix, #0
+    add  ix, sp
+    dec  sp                 ;; -1 (ix) = the token
+
+    ld   l, 4 (ix)          ;; hl = src
+    ld   h, 5 (ix)
+    ld   a, 6 (ix)          ;; 6 (ix) = src + len, the end of the block
+    add  a, l
+    ld   6 (ix), a
+    ld   a, 7 (ix)
+    adc  a, h
+    ld   7 (ix), a
+    ld   e, 8 (ix)          ;; de = dst
+    ld   d, 9 (ix)
+
+0001$:
+    ld   a, (hl)            ;; token: literal length, match length - 4
+    inc  hl
+    ld   -1 (ix), a
+    rrca
+    rrca
+    rrca
+    rrca
+    and  #0x0f
+    ld   c, a
+    ld   b, #0
+    cp   #15
+    call z, 0010$
+    ld   a, b
+    or   c
+    jr   z, 0002$
+    ldir                    ;; the literals
+
+0002$:
+    ld   a, l               ;; the last sequence stops after its literals
+    sub  6 (ix)
+    ld   c, a
+    ld   a, h
+    sbc  a, 7 (ix)
+    jr   c, 0003$           ;; src < end, a match follows
+    or   c
+    jr   z, 0009$           ;; src == end, done
+    jr   0008$              ;; past the end
+
+0003$:
+    ld   c, (hl)            ;; bc = offset
+    inc  hl
+    ld   b, (hl)
+    inc  hl
+    push hl
+    ld   l, e               ;; the match starts offset bytes back
+    ld   h, d
+    or   a
+    sbc  hl, bc
+    ex   (sp), hl           ;; keep it on the stack, hl = src
+
+    ld   a, -1 (ix)
+    and  #0x0f
+    ld   c, a
+    ld   b, #0
+    cp   #15
+    call z, 0010$
+    inc  bc
+    inc  bc
+    inc  bc
+    inc  bc
+
+    ex   (sp), hl           ;; hl = match, src on the stack
+    ldir
+    pop  hl
+    ld   a, l               ;; a block ends with literals, not a match
+    sub  6 (ix)
+    ld   a, h
+    sbc  a, 7 (ix)
+    jr   c, 0001$
+
+0008$:
+    ld   e, 8 (ix)          ;; a bad block, return dst
+    ld   d, 9 (ix)
+
+0009$:
+    ex   de, hl             ;; return the end of the output
+    ld   sp, ix
+    pop  ix
+    ret
+
+0010$:                      ;; bc += length bytes, each 255 means more
+    ld   a, (hl)
+    inc  hl
+    push af
+    add  a, c
+    ld   c, a
+    jr   nc, 0011$
+    inc  b
+0011$:
+    pop  af
+    inc  a
+    jr   z, 0010$
+    ret
+  __endasm;
 }
 
 /*
@@ -600,10 +1699,22 @@ retry:
           if (ch == '#')
             break;
           checksum = checksum + ch;
+          if (ch == '}')
+            {
+              /* escaped binary data (X packets), the next char is
+                 the real one XORed with 0x20.  Both count towards
+                 the checksum */
+              ch = getDebugChar ();
+              checksum = checksum + ch;
+              ch = ch ^ 0x20;
+            }
           buffer[count] = ch;
           count = count + 1;
         }
       buffer[count] = 0;
+      remcomInCount = count;
+      if (ch != '#')
+        stubStats.overlong++;
 
       if (ch == '#')
         {
@@ -614,11 +1725,15 @@ retry:
 
           if (checksum != xmitcsum)
             {
-              putDebugChar ('-');       /* failed checksum */
+              stubStats.badChecksums++;
+              if (!noack_mode)
+                putDebugChar ('-');     /* failed checksum */
             }
           else
             {
-              putDebugChar ('+');       /* successful transfer */
+              stubStats.packetsIn++;
+              if (!noack_mode)
+                putDebugChar ('+');     /* successful transfer */
 
               /* if a sequence char is present, reply the sequence ID */
               if (buffer[2] == ':')
@@ -638,56 +1753,63 @@ retry:
 
 /* send the packet in buffer. */
 
+/* The frame is encoded into remcomTxBuffer once, checksum included,
+   and sent in one burst.  A retransmit only replays the buffer. */
 static void
 putpacket (char *buffer)
 {
-  int checksum;
+  char *src = buffer;
+  char *dst = remcomTxBuffer;
+  unsigned char checksum;
 
   /*  $<packet info>#<checksum>. */
-  do
+  *dst++ = '$';
+  checksum = 0;
+
+  while (*src)
     {
-      char *src = buffer;
-      putDebugChar ('$');
-      checksum = 0;
+      char ch = *src++;
+      unsigned char repeat = 0;
 
-      while (*src)
-        {
-          int runlen;
+      *dst++ = ch;
+      checksum += ch;
 
-          /* Do run length encoding */
-          for (runlen = 0; runlen < 100; runlen ++) 
-            {
-              if (src[0] != src[runlen]) 
-                {
-                  if (runlen > 3) 
-                    {
-                      int encode;
-                      /* Got a useful amount */
-                      putDebugChar (*src);
-                      checksum += *src;
-                      putDebugChar ('*');
-                      checksum += '*';
-                      checksum += (encode = runlen + ' ' - 4);
-                      putDebugChar (encode);
-                      src += runlen;
-                    }
-                  else
-                    {
-                      putDebugChar (*src);
-                      checksum += *src;
-                      src++;
-                    }
-                  break;
-                }
-            }
+      /* Do run length encoding, long runs go out in several chunks */
+      while (repeat < RLE_MAX_REPEAT && *src == ch)
+        {
+          repeat++;
+          src++;
         }
 
+      /* give back the copies that would make an illegal count */
+      while (RLE_BAD_REPEAT (repeat))
+        {
+          repeat--;
+          src--;
+        }
 
-      putDebugChar ('#');
-      putDebugChar (highhex(checksum));
-      putDebugChar (lowhex(checksum));
-    }
-  while  (getDebugChar() != '+');
+      if (repeat >= RLE_MIN_REPEAT)
+        {
+          /* Got a useful amount */
+          *dst++ = '*';
+          *dst++ = repeat + RLE_BIAS;
+          checksum += '*' + repeat + RLE_BIAS;
+        }
+      else
+        src -= repeat;          /* too short, send them one by one */
+    }
+
+  *dst++ = '#';
+  *dst++ = highhex (checksum);
+  *dst++ = lowhex (checksum);
+
+  stubStats.packetsOut++;
+  putDebugBuf (remcomTxBuffer, dst - remcomTxBuffer);
+  while (!noack_mode && getDebugChar () != '+')
+    {
+      stubStats.retransmits++;
+      putDebugBuf (remcomTxBuffer, dst - remcomTxBuffer);
+    }
 }
 
 
@@ -701,58 +1823,1064 @@ computeSignal (int exceptionVector)
   int sigval;
   switch (exceptionVector)
     {
-    case Z80_NMI:
-      sigval = 5; 
-      break;
+    case Z80_NMI:
+      sigval = 5; 
+      break;
+
+    case Z80_RST08_VEC:
+      sigval = 5;
+      break;
+
+    case Z80_UART_BREAK:
+      sigval = 2;               /* SIGINT */
+      break;
+
+    default:
+      sigval = 7;               /* "software generated"*/
+      break;
+    }
+  return (sigval);
+}
+
+void
+doSStep (void)
+{
+  char *instrMem;
+  char *nextInstrMem;
+  unsigned char opcode;
+
+  struct tab_elt *p;
+
+  instrMem = (char *) registers.pc;
+
+  opcode = *instrMem;
+  stepped = 1;
+
+  p = &opc_main[opc_main_idx[opcode]];
+
+  nextInstrMem = (char *) p->fp(instrMem, p);
+
+  instrMem = nextInstrMem;
+  instrBuffer.memAddr = instrMem;
+  instrBuffer.oldInstr = *instrMem;
+  *instrMem = SSTEP_INSTR;
+}
+
+
+/* Undo the effect of a previous doSStep.  If we single stepped,
+   restore the old instruction. */
+void
+undoSStep (void)
+{
+  if (stepped)
+    { char *instrMem;
+      instrMem = instrBuffer.memAddr;
+      *instrMem = instrBuffer.oldInstr;
+    }
+  stepped = 0;
+}
+
+/* Return the breakpoint at addr, 0 if there is none. */
+static breakData *
+find_breakpoint (char *addr)
+{
+  breakData *bp;
+
+  for (bp = breakTable; bp < breakTable + MAX_BREAKPOINTS; bp++)
+    if (bp->inUse && bp->memAddr == addr)
+      return bp;
+  return 0;
+}
+
+/* Return the first enabled tracepoint at addr, 0 if there is none. */
+static traceData *
+find_tracepoint (char *addr)
+{
+  traceData *tp;
+
+  for (tp = traceTable; tp < traceTable + MAX_TRACEPOINTS; tp++)
+    if (tp->inUse && tp->enabled && tp->memAddr == addr)
+      return tp;
+  return 0;
+}
+
+/* Keep the ;XLL,EE..EE conditions of a Z0 packet in bp.  If they don't
+   fit or don't parse the breakpoint is left unconditional, gdb still
+   checks the condition itself when it is reported. */
+static void
+set_conditions (breakData *bp, char *ptr)
+{
+  unsigned char *cond = bp->cond;
+  int len;
+
+  bp->condLen = 0;
+  while (*ptr == ';' && ptr[1] == 'X')
+    {
+      ptr += 2;
+      if (!hexToInt (&ptr, &len) || *(ptr++) != ',')
+        return;
+      if (len < 1 || len > BP_COND_MAX - (cond - bp->cond) - 1)
+        return;
+      *cond++ = len;
+      hex2mem (ptr, (char *) cond, len);
+      cond += len;
+      ptr += 2 * len;
+    }
+  bp->condLen = cond - bp->cond;
+}
+
+/* Z0, add addr to the breakpoint table, or update its conditions if it
+   is already there.  Return non zero if the table is full. */
+static int
+set_breakpoint (char *addr, char *conds)
+{
+  breakData *bp = find_breakpoint (addr);
+
+  if (!bp)
+    {
+      for (bp = breakTable; bp < breakTable + MAX_BREAKPOINTS; bp++)
+        if (!bp->inUse)
+          break;
+      if (bp == breakTable + MAX_BREAKPOINTS)
+        return 1;
+      bp->memAddr = addr;
+      bp->inUse = 1;
+    }
+  set_conditions (bp, conds);
+  return 0;
+}
+
+/* z0, drop addr from the breakpoint table. */
+static void
+clear_breakpoint (char *addr)
+{
+  breakData *bp = find_breakpoint (addr);
+
+  if (bp)
+    bp->inUse = 0;
+}
+
+/* Patch BREAK_INST at every breakpoint, and every tracepoint while a
+   trace runs, but the ones at skip, before resuming the inferior. */
+static void
+insert_breakpoints (char *skip)
+{
+  breakData *bp;
+  traceData *tp;
+
+  for (bp = breakTable; bp < breakTable + MAX_BREAKPOINTS; bp++)
+    {
+      bp->inserted = (bp->inUse && bp->memAddr != skip);
+      if (bp->inserted)
+        {
+          bp->oldInstr = *bp->memAddr;
+          *bp->memAddr = BREAK_INST;
+        }
+    }
+  for (tp = traceTable; tp < traceTable + MAX_TRACEPOINTS; tp++)
+    {
+      tp->inserted = (tracing && tp->inUse && tp->enabled
+                      && tp->memAddr != skip);
+      if (tp->inserted)
+        {
+          tp->oldInstr = *tp->memAddr;
+          *tp->memAddr = BREAK_INST;
+        }
+    }
+  breaksInserted = 1;
+}
+
+/* Put the original instructions back, when the inferior stops.  This
+   goes backwards so that two patches at one address unwind right. */
+static void
+remove_breakpoints (void)
+{
+  breakData *bp;
+  traceData *tp;
+
+  if (!breaksInserted)
+    return;
+
+  for (tp = traceTable + MAX_TRACEPOINTS; tp-- > traceTable;)
+    if (tp->inserted)
+      *tp->memAddr = tp->oldInstr;
+  for (bp = breakTable + MAX_BREAKPOINTS; bp-- > breakTable;)
+    if (bp->inserted)
+      *bp->memAddr = bp->oldInstr;
+  breaksInserted = 0;
+}
+
+/* Return non zero if gdb set any watchpoint. */
+static int
+watchpoints_set (void)
+{
+  watchData *wp;
+
+  for (wp = watchTable; wp < watchTable + MAX_WATCHPOINTS; wp++)
+    if (wp->inUse)
+      return 1;
+  return 0;
+}
+
+/* Z2/Z3/Z4, watch len bytes at addr.  Return non zero on failure. */
+static int
+set_watchpoint (char type, char *addr, int len)
+{
+  watchData *wp;
+
+  if (len < 1 || len > WATCH_MAXLEN)
+    return 1;
+
+  for (wp = watchTable; wp < watchTable + MAX_WATCHPOINTS; wp++)
+    if (!wp->inUse)
+      {
+        wp->type = type;
+        wp->memAddr = addr;
+        wp->len = len;
+        wp->inUse = 1;
+        return 0;
+      }
+  return 1;
+}
+
+/* z2/z3/z4, forget the matching watchpoint. */
+static void
+clear_watchpoint (char type, char *addr, int len)
+{
+  watchData *wp;
+
+  for (wp = watchTable; wp < watchTable + MAX_WATCHPOINTS; wp++)
+    if (wp->inUse && wp->type == type
+        && wp->memAddr == addr && wp->len == len)
+      {
+        wp->inUse = 0;
+        return;
+      }
+}
+
+/* Before a step, remember the watched values and what memory the
+   instruction at PC is going to touch. */
+static void
+watch_snapshot (void)
+{
+  watchData *wp;
+
+  for (wp = watchTable; wp < watchTable + MAX_WATCHPOINTS; wp++)
+    if (wp->inUse)
+      memcpy (wp->oldData, wp->memAddr, wp->len);
+
+  accessKind = mem_operand ((char *) registers.pc, &accessAddr, &accessLen);
+}
+
+/* Does [addr, addr + len) overlap the bytes wp watches? */
+static char
+watch_overlaps (watchData *wp, char *addr, unsigned long len)
+{
+  unsigned long start = (unsigned int) addr;
+
+  return (start < (unsigned int) wp->memAddr + (unsigned long) wp->len
+          && (unsigned int) wp->memAddr < start + len);
+}
+
+/* After a step, set watchHit to the first watchpoint that triggered. */
+static void
+check_watchpoints (void)
+{
+  watchData *wp;
+  char kind;
+
+  for (wp = watchTable; wp < watchTable + MAX_WATCHPOINTS; wp++)
+    {
+      if (!wp->inUse)
+        continue;
+
+      /* writes: did the value change? */
+      if (wp->type != '3' && memcmp (wp->oldData, wp->memAddr, wp->len))
+        break;
+      if (wp->type == '2')
+        continue;
+
+      /* reads, and for '4' writes of the same value: did a decoded
+         operand overlap the watched bytes? */
+      kind = (wp->type == '3') ? MEM_RD : MEM_RD | MEM_WR;
+      if ((accessKind & kind) && watch_overlaps (wp, accessAddr, accessLen))
+        break;
+      if (wp->type == '4' && (accessKind & MEM_MOVE)
+          && watch_overlaps (wp, accessDest, accessLen))
+        break;
+    }
+
+  watchHit = (wp < watchTable + MAX_WATCHPOINTS) ? wp : 0;
+}
+
+/* Let the inferior go, one instruction only if stepping.  With
+   watchpoints set a continue is done as a string of steps too. */
+static void
+resume (int stepping)
+{
+  char *skip = 0;
+
+  watchContinue = 0;
+  if (watchpoints_set ())
+    {
+      if (!stepping)
+        watchContinue = 1;
+      stepping = 1;
+      watch_snapshot ();
+    }
+
+  /* a tracepoint at PC was collected on the way in, a breakpoint there
+     whose condition was false is to be stepped over, and a step runs
+     the instruction at PC whatever is there (range and watch steps
+     land on such breakpoints): leave them out for this instruction, a
+     continue does it as a step first */
+  if (stepOver || stepping
+      || tracing && find_tracepoint ((char *) registers.pc))
+    {
+      skip = (char *) registers.pc;
+      if (!stepping)
+        stepOver = 1;
+    }
+
+  if (stepping || stepOver)
+    doSStep ();
+  insert_breakpoints (skip);
+}
+
+/* Value of register regno, in g packet order */
+static long
+reg_value (unsigned int regno)
+{
+  unsigned char *reg = (unsigned char *) &registers;
+  unsigned int i;
+
+  for (i = 0; i < regno; i++)
+    reg += regSizes[i];
+  if (regSizes[regno] == 1)
+    return reg[0];
+  return (unsigned int) (reg[0] | (reg[1] << 8));
+}
+
+/* Run the len bytes of agent expression at code.  Return non zero if
+   its value is, or if it can't be run here or runs too long (so the
+   stop is reported and gdb decides). */
+static int
+ax_eval (unsigned char *code, unsigned char len)
+{
+  unsigned char *pc = code;
+  unsigned char *end = code + len;
+  unsigned char op, n;
+  long *top = axStack - 1;      /* last item pushed */
+  long a, b;
+  unsigned int steps = 0;
+
+  while (pc < end)
+    {
+      if (++steps > AX_MAX_STEPS)
+        return 1;
+      op = *pc++;
+
+      /* operands of binary operations: b was on top of a */
+      if (op >= AX_ADD && op <= AX_RSH_UNSIGNED
+          || op >= AX_BIT_AND && op <= AX_BIT_XOR
+          || op >= AX_EQUAL && op <= AX_LESS_UNSIGNED)
+        {
+          if (top < axStack + 1)
+            return 1;
+          b = *top--;
+          a = *top;
+        }
+
+      switch (op)
+        {
+        case AX_ADD:            *top = a + b; break;
+        case AX_SUB:            *top = a - b; break;
+        case AX_MUL:            *top = a * b; break;
+        case AX_LSH:            *top = a << b; break;
+        case AX_RSH_SIGNED:     *top = a >> b; break;
+        case AX_RSH_UNSIGNED:   *top = (unsigned long) a >> b; break;
+        case AX_BIT_AND:        *top = a & b; break;
+        case AX_BIT_OR:         *top = a | b; break;
+        case AX_BIT_XOR:        *top = a ^ b; break;
+        case AX_EQUAL:          *top = (a == b); break;
+        case AX_LESS_SIGNED:    *top = (a < b); break;
+        case AX_LESS_UNSIGNED:  *top = ((unsigned long) a < (unsigned long) b); break;
+
+        case AX_DIV_SIGNED:
+        case AX_DIV_UNSIGNED:
+        case AX_REM_SIGNED:
+        case AX_REM_UNSIGNED:
+          if (b == 0)
+            return 1;
+          if (op == AX_DIV_SIGNED)
+            *top = a / b;
+          else if (op == AX_DIV_UNSIGNED)
+            *top = (unsigned long) a / (unsigned long) b;
+          else if (op == AX_REM_SIGNED)
+            *top = a % b;
+          else
+            *top = (unsigned long) a % (unsigned long) b;
+          break;
+
+        case AX_TRACE:          /* nothing to collect, just pop */
+          if (top < axStack + 1)
+            return 1;
+          top -= 2;
+          break;
+        case AX_TRACE_QUICK:
+          pc++;
+          break;
+
+        case AX_LOG_NOT:
+        case AX_BIT_NOT:
+        case AX_EXT:
+        case AX_ZERO_EXT:
+        case AX_REF8:
+        case AX_REF16:
+        case AX_REF32:
+        case AX_IF_GOTO:
+        case AX_END:
+        case AX_DUP:
+        case AX_POP:
+          if (top < axStack)
+            return 1;
+          switch (op)
+            {
+            case AX_LOG_NOT:  *top = !*top; break;
+            case AX_BIT_NOT:  *top = ~*top; break;
+            case AX_EXT:
+              n = *pc++;
+              if (n == 0)
+                return 1;
+              if (n < 32 && (*top & (1L << (n - 1))))
+                *top |= -1L << n;
+              else if (n < 32)
+                *top &= (1L << n) - 1;
+              break;
+            case AX_ZERO_EXT:
+              n = *pc++;
+              if (n < 32)
+                *top &= (1L << n) - 1;
+              break;
+            case AX_REF8:
+              *top = *(unsigned char *) (unsigned int) *top;
+              break;
+            case AX_REF16:
+              *top = *(unsigned short *) (unsigned int) *top;
+              break;
+            case AX_REF32:
+              *top = *(unsigned long *) (unsigned int) *top;
+              break;
+            case AX_IF_GOTO:
+              if (*top--)
+                pc = code + ((pc[0] << 8) | pc[1]);
+              else
+                pc += 2;
+              break;
+            case AX_END:
+              return (*top != 0);
+            case AX_DUP:
+              if (top >= axStack + AX_STACK_SIZE - 1)
+                return 1;
+              top[1] = top[0];
+              top++;
+              break;
+            case AX_POP:
+              top--;
+              break;
+            }
+          break;
+
+        case AX_GOTO:
+          pc = code + ((pc[0] << 8) | pc[1]);
+          break;
+
+        case AX_CONST8:
+        case AX_CONST16:
+        case AX_CONST32:
+        case AX_CONST64:
+        case AX_REG:
+        case AX_PICK:
+          if (top >= axStack + AX_STACK_SIZE - 1)
+            return 1;
+          a = 0;
+          switch (op)
+            {
+            case AX_CONST64:    /* keep the low 32 bits */
+              pc += 4;
+            case AX_CONST32:
+              a = ((long) pc[0] << 24) | ((long) pc[1] << 16);
+              pc += 2;
+            case AX_CONST16:
+              a |= (unsigned int) *pc++ << 8;
+            case AX_CONST8:
+              a |= *pc++;
+              break;
+            case AX_REG:
+              a = (pc[0] << 8) | pc[1];
+              pc += 2;
+              if (a >= NUMREGS)
+                return 1;
+              a = reg_value (a);
+              break;
+            case AX_PICK:
+              n = *pc++;
+              if (top - n < axStack)
+                return 1;
+              a = top[-n];
+              break;
+            }
+          *++top = a;
+          break;
+
+        case AX_SWAP:
+          if (top < axStack + 1)
+            return 1;
+          a = top[0];
+          top[0] = top[-1];
+          top[-1] = a;
+          break;
+
+        case AX_ROT:            /* a b c -> c a b */
+          if (top < axStack + 2)
+            return 1;
+          a = top[0];
+          top[0] = top[-1];
+          top[-1] = top[-2];
+          top[-2] = a;
+          break;
+
+        default:                /* floats, ref64, tracing, printf... */
+          return 1;
+        }
+    }
+
+  /* ran off the end without an AX_END */
+  return 1;
+}
+
+/* Return non zero if any of bp's conditions holds. */
+static int
+breakpoint_condition (breakData *bp)
+{
+  unsigned char *cond = bp->cond;
+
+  while (cond < bp->cond + bp->condLen)
+    {
+      if (ax_eval (cond + 1, cond[0]))
+        return 1;
+      cond += 1 + cond[0];
+    }
+  return 0;
+}
+
+/* Return the tracepoint numbered num, 0 if there is none. */
+static traceData *
+tracepoint_num (unsigned int num)
+{
+  traceData *tp;
+
+  for (tp = traceTable; tp < traceTable + MAX_TRACEPOINTS; tp++)
+    if (tp->inUse && tp->num == num)
+      return tp;
+  return 0;
+}
+
+/* QTDP, after the "QTDP:".  Return non zero on error. */
+static int
+trace_define (char *ptr)
+{
+  traceData *tp;
+  traceMem *mem;
+  char action;
+  int num, addr, value;
+
+  action = (*ptr == '-');
+  if (action)
+    ptr++;
+  if (!hexToInt (&ptr, &num) || *(ptr++) != ':'
+      || !hexToInt (&ptr, &addr) || *(ptr++) != ':')
+    return 1;
+
+  /* n:addr:E|D:step:pass, a new definition replaces an old one */
+  if (!action)
+    {
+      tp = tracepoint_num (num);
+      if (!tp)
+        for (tp = traceTable; tp < traceTable + MAX_TRACEPOINTS; tp++)
+          if (!tp->inUse)
+            break;
+      if (tp == traceTable + MAX_TRACEPOINTS)
+        return 1;
+      memset (tp, 0, sizeof (traceData));
+      tp->num = num;
+      tp->memAddr = (char *) addr;
+      tp->enabled = (*(ptr++) == 'E');
+      if (*(ptr++) != ':' || !hexToInt (&ptr, &value) || *(ptr++) != ':'
+          || !hexToInt (&ptr, &value))
+        return 1;
+      tp->pass = value;
+      tp->inUse = 1;
+      return 0;
+    }
+
+  /* -n:addr:action */
+  tp = tracepoint_num (num);
+  if (!tp || tp->memAddr != (char *) addr)
+    return 1;
+  if (*ptr == 'S')      /* while-stepping actions, not done here */
+    return 0;
+  while (*ptr && *ptr != '-')
+    switch (*(ptr++))
+      {
+      case 'R':         /* the registers are in every frame anyway */
+        hexToInt (&ptr, &value);
+        break;
+      case 'M':
+        if (tp->nmem == TP_MAX_MEM)
+          return 1;
+        mem = &tp->mem[tp->nmem];
+        if (!hexToIndex (&ptr, &value) || *(ptr++) != ',')
+          return 1;
+        mem->basereg = value;
+        if (value >= NUMREGS || value < -1)
+          return 1;
+        if (!hexToInt (&ptr, &mem->offset) || *(ptr++) != ','
+            || !hexToInt (&ptr, &value))
+          return 1;
+        mem->len = value;
+        tp->nmem++;
+        break;
+      case 'X':         /* expressions to collect, not done here */
+        if (!hexToInt (&ptr, &value) || *(ptr++) != ',')
+          return 1;
+        ptr += 2 * value;
+        break;
+      default:
+        return 1;
+      }
+  return 0;
+}
+
+/* QTStart, throw away the old frames and start collecting */
+static void
+trace_start (void)
+{
+  traceData *tp;
+
+  for (tp = traceTable; tp < traceTable + MAX_TRACEPOINTS; tp++)
+    tp->hits = 0;
+  traceUsed = traceFrames = 0;
+  traceFrame = -1;
+  tracing = 1;
+}
+
+/* Append a frame to traceBuf for every tracepoint at pc.  Return non
+   zero if there was any, even when the trace stopped. */
+static int
+collect_trace (char *pc)
+{
+  traceData *tp;
+  traceMem *mem;
+  traceFrameHdr *frame;
+  traceBlock *block;
+  unsigned int size;
+  char *addr;
+  int found = 0;
+
+  for (tp = traceTable; tp < traceTable + MAX_TRACEPOINTS; tp++)
+    {
+      if (!tp->inUse || !tp->enabled || tp->memAddr != pc)
+        continue;
+      found = 1;
+      if (!tracing)
+        continue;
+
+      size = sizeof (traceFrameHdr);
+      for (mem = tp->mem; mem < tp->mem + tp->nmem; mem++)
+        size += sizeof (traceBlock) + mem->len;
+      if (size > TRACE_BUF_SIZE - traceUsed)
+        {
+          tracing = 0;
+          traceStop = TRACE_FULL;
+          continue;
+        }
+
+      frame = (traceFrameHdr *) (traceBuf + traceUsed);
+      frame->tpnum = tp->num;
+      frame->size = size - sizeof (traceFrameHdr);
+      memcpy (frame->regs, (char *) &registers, NUMREGBYTES);
+      block = (traceBlock *) (frame + 1);
+      for (mem = tp->mem; mem < tp->mem + tp->nmem; mem++)
+        {
+          addr = (char *) mem->offset;
+          if (mem->basereg >= 0)
+            addr += (unsigned int) reg_value (mem->basereg);
+          block->addr = (unsigned int) addr;
+          block->len = mem->len;
+          memcpy (block + 1, addr, mem->len);
+          block = (traceBlock *) ((char *) (block + 1) + mem->len);
+        }
+      traceUsed += size;
+      traceFrames++;
+
+      tp->hits++;
+      if (tp->pass && tp->hits >= tp->pass)
+        {
+          tracing = 0;
+          traceStop = TRACE_PASS;
+          traceStopTp = tp->num;
+        }
+    }
+  return found;
+}
+
+/* Return trace frame n, 0 if there is no such frame. */
+static traceFrameHdr *
+trace_frame (int n)
+{
+  unsigned char *frame = traceBuf;
+
+  if (n < 0 || (unsigned int) n >= traceFrames)
+    return 0;
+  while (n--)
+    frame += sizeof (traceFrameHdr) + ((traceFrameHdr *) frame)->size;
+  return (traceFrameHdr *) frame;
+}
+
+/* QTFrame, after the "QTFrame:".  Select a frame and put the reply in
+   remcomOutBuffer, return non zero if the packet is bad. */
+static int
+trace_select (char *ptr)
+{
+  traceFrameHdr *frame;
+  char *buf;
+  char by = 0;
+  int n, value;
+
+  if (!strncmp ("pc:", ptr, strlen ("pc:")))
+    {
+      by = 'p';
+      ptr += strlen ("pc:");
+    }
+  else if (!strncmp ("tdp:", ptr, strlen ("tdp:")))
+    {
+      by = 't';
+      ptr += strlen ("tdp:");
+    }
+  if (by ? !hexToInt (&ptr, &value) : !hexToIndex (&ptr, &value))
+    return 1;
+
+  if (!by && value == -1)
+    {
+      traceFrame = -1;
+      strcpy (remcomOutBuffer, "OK");
+      return 0;
+    }
+
+  /* by number, or the first match after the selected frame; PC is the
+     last register */
+  n = by ? traceFrame + 1 : value;
+  for (; (frame = trace_frame (n)) != 0; n++)
+    if (!by
+        || by == 'p'
+           && *(unsigned int *) (frame->regs + NUMREGBYTES - 2) == value
+        || by == 't' && frame->tpnum == value)
+      break;
+
+  if (!frame)
+    {
+      strcpy (remcomOutBuffer, "F-1");
+      return 0;
+    }
+  traceFrame = n;
+  remcomOutBuffer[0] = 'F';
+  buf = word2hex (n, remcomOutBuffer + 1);
+  *buf++ = 'T';
+  word2hex (frame->tpnum, buf);
+  return 0;
+}
+
+/* Where the selected trace frame holds the len bytes at addr, 0 if it
+   doesn't.  len is cut down to what the frame has from addr. */
+static char *
+trace_memory (char *addr, int *len)
+{
+  traceFrameHdr *frame = trace_frame (traceFrame);
+  traceBlock *block = (traceBlock *) (frame + 1);
+  char *end = (char *) (frame + 1) + frame->size;
+  unsigned int offset;
+
+  for (; (char *) block < end;
+       block = (traceBlock *) ((char *) (block + 1) + block->len))
+    {
+      offset = (unsigned int) addr - block->addr;
+      if ((unsigned int) addr >= block->addr && offset < block->len)
+        {
+          if ((unsigned int) *len > block->len - offset)
+            *len = block->len - offset;
+          return (char *) (block + 1) + offset;
+        }
+    }
+  return 0;
+}
+
+/* qTStatus reply */
+static void
+trace_status (char *buf)
+{
+  *buf++ = 'T';
+  *buf++ = tracing ? '1' : '0';
+  *buf = 0;
+  if (!tracing)
+    {
+      if (traceStop == TRACE_STOPPED)
+        strcpy (buf, ";tstop:0");
+      else if (traceStop == TRACE_FULL)
+        strcpy (buf, ";tfull:0");
+      else if (traceStop == TRACE_PASS)
+        {
+          strcpy (buf, ";tpasscount:");
+          word2hex (traceStopTp, buf + strlen (buf));
+        }
+      else
+        strcpy (buf, ";tnotrun:0");
+    }
+  buf += strlen (buf);
+  strcpy (buf, ";tframes:");
+  buf = word2hex (traceFrames, buf + strlen (buf));
+  strcpy (buf, ";tcreated:");
+  buf = word2hex (traceFrames, buf + strlen (buf));
+  strcpy (buf, ";tfree:");
+  buf = word2hex (TRACE_BUF_SIZE - traceUsed, buf + strlen (buf));
+  strcpy (buf, ";tsize:");
+  buf = word2hex (TRACE_BUF_SIZE, buf + strlen (buf));
+  strcpy (buf, ";circular:0");
+}
+
+/* Append "n:r;", register number regno and the size bytes at reg */
+static char *
+expedite_reg (char *buf, unsigned char regno, char *reg, int size)
+{
+  *buf++ = highhex (regno);
+  *buf++ = lowhex (regno);
+  *buf++ = ':';
+  buf = mem2hex (reg, buf, size);
+  *buf++ = ';';
+  *buf = 0;
+  return (buf);
+}
+
+/* Build the reply telling gdb why we stopped in remcomOutBuffer.  The
+   registers gdb needs on every stop come along, so a step doesn't
+   cost a g packet too. */
+static void
+stop_reply (int sigval)
+{
+  char *buf = remcomOutBuffer;
+
+  *buf++ = 'T';
+  *buf++ = highhex (sigval);
+  *buf++ = lowhex (sigval);
+  buf = expedite_reg (buf, REGNO_PC, (char *) &registers.pc, 2);
+  buf = expedite_reg (buf, REGNO_SP, (char *) &registers.sp, 2);
+  buf = expedite_reg (buf, REGNO_A, (char *) &registers.a, 1);
+  buf = expedite_reg (buf, REGNO_F, (char *) &registers.f, 1);
+  buf = expedite_reg (buf, REGNO_HL, (char *) &registers.hl, 2);
+  if (watchHit)
+    {
+      if (watchHit->type == '2')
+        strcpy (buf, "watch:");
+      else if (watchHit->type == '3')
+        strcpy (buf, "rwatch:");
+      else
+        strcpy (buf, "awatch:");
+      buf = word2hex ((unsigned int) watchHit->memAddr, buf + strlen (buf));
+      strcpy (buf, ";");
+    }
+  else if (breakHit)
+    strcpy (buf, "swbreak:;");
+}
 
-    case Z80_RST08_VEC:
-      sigval = 5;
-      break;
+/* Add text to the O packet being built in remcomOutBuffer, sending it
+   first when text does not fit.  Whatever is left is sent by the qRcmd
+   handler, before the final OK. */
+static void
+monitor_puts (char *text)
+{
+  unsigned int len = strlen (text);
+  unsigned int used = strlen (remcomOutBuffer);
 
-    default:
-      sigval = 7;               /* "software generated"*/
-      break;
+  if (used + 2 * len >= BUFMAX)
+    {
+      putpacket (remcomOutBuffer);
+      used = 0;
     }
-  return (sigval);
+  if (!used)
+    remcomOutBuffer[used++] = 'O';
+  mem2hex (text, remcomOutBuffer + used, len);
 }
 
-void
-doSStep (void)
+/* Count the PC of the inferior in the profile histogram. */
+static void
+profile_sample (void)
 {
-  char *instrMem;
-  char *nextInstrMem;
-  unsigned short opcode;
+  unsigned int offset = (unsigned int) registers.pc - profileBase;
+  unsigned int *count;
 
-  struct tab_elt *p;
+  if (offset > profileLast)
+    count = &profileOther;
+  else
+    count = &profileHist[offset >> profileShift];
+  if (++*count == 0)
+    --*count;                   /* saturate rather than wrap */
+  profileSamples++;
+}
 
-  instrMem = (char *) registers.pc;
+/* monitor profile start [AAAA,LLLL], stop or dump.  start clears the
+   histogram and has it cover LLLL bytes at AAAA (hex, the whole 64K by
+   default), dump lists the buckets that got samples.  Return non zero
+   for an unknown command. */
+static int
+profile_command (char *cmd)
+{
+  char line[32];
+  char *buf;
+  int base, len;
+  unsigned int i;
 
-  opcode = *instrMem;
-  stepped = 1;
+  if (!strncmp ("start", cmd, strlen ("start")))
+    {
+      cmd += strlen ("start");
+      while (*cmd == ' ')
+        cmd++;
+      profileBase = 0;
+      profileLast = 0xFFFF;
+      if (hexToInt (&cmd, &base))
+        if (*(cmd++) == ',')
+          if (hexToInt (&cmd, &len) && len)
+            {
+              profileBase = base;
+              profileLast = len - 1;
+            }
+      for (profileShift = 0;
+           (profileLast >> profileShift) >= PROFILE_BUCKETS; profileShift++)
+        ;
+      memset (profileHist, 0, sizeof (profileHist));
+      profileOther = 0;
+      profileSamples = 0;
+      profiling = 1;
+      return 0;
+    }
 
-  for (p = opc_main; p->val != (opcode & p->mask); ++p)
-    ;
+  if (!strncmp ("stop", cmd, strlen ("stop")))
+    {
+      profiling = 0;
+      return 0;
+    }
 
-  nextInstrMem = (char *) p->fp(instrMem, p);
+  if (!strncmp ("dump", cmd, strlen ("dump")))
+    {
+      strcpy (line, "samples ");
+      buf = long2hex (profileSamples, line + strlen (line));
+      strcpy (buf, ", other ");
+      buf = word2hex (profileOther, buf + strlen (buf));
+      strcpy (buf, "\n");
+      monitor_puts (line);
+
+      /* start-end count, one line per bucket with samples */
+      for (i = 0; i < PROFILE_BUCKETS; i++)
+        if (profileHist[i])
+          {
+            buf = word2hex (profileBase + (i << profileShift), line);
+            *buf++ = '-';
+            buf = word2hex (profileBase + ((i + 1) << profileShift) - 1,
+                            buf);
+            *buf++ = ' ';
+            buf = word2hex (profileHist[i], buf);
+            strcpy (buf, "\n");
+            monitor_puts (line);
+          }
+      return 0;
+    }
 
-  instrMem = nextInstrMem;
-  instrBuffer.memAddr = instrMem;
-  instrBuffer.oldInstr = *instrMem;
-  *instrMem = SSTEP_INSTR;
+  return 1;
 }
 
-
-/* Undo the effect of a previous doSStep.  If we single stepped,
-   restore the old instruction. */
-void
-undoSStep (void)
+/* monitor stats [reset]: show the stubStats counters, or clear them.
+   Return non zero for an unknown command. */
+static int
+stats_command (char *cmd)
 {
-  if (stepped)
-    { char *instrMem;
-      instrMem = instrBuffer.memAddr;
-      *instrMem = instrBuffer.oldInstr;
+  char line[64];
+  char *buf;
+  unsigned int i;
+
+  if (!strncmp ("reset", cmd, strlen ("reset")))
+    {
+      memset (&stubStats, 0, sizeof (stubStats));
+#ifdef UART_RX_IRQ
+      rx_overruns = 0;
+#endif
+      return 0;
     }
-  stepped = 0;
+  if (*cmd)
+    return 1;
+
+  strcpy (line, "packets in ");
+  buf = long2hex (stubStats.packetsIn, line + strlen (line));
+  strcpy (buf, ", out ");
+  buf = long2hex (stubStats.packetsOut, buf + strlen (buf));
+  strcpy (buf, "\n");
+  monitor_puts (line);
+
+  strcpy (line, "bad checksums ");
+  buf = word2hex (stubStats.badChecksums, line + strlen (line));
+  strcpy (buf, ", overlong ");
+  buf = word2hex (stubStats.overlong, buf + strlen (buf));
+  strcpy (buf, ", resent ");
+  buf = word2hex (stubStats.retransmits, buf + strlen (buf));
+  strcpy (buf, "\n");
+  monitor_puts (line);
+
+#ifdef UART_RX_IRQ
+  strcpy (line, "rx overruns ");
+  buf = word2hex (rx_overruns, line + strlen (line));
+  strcpy (buf, "\n");
+  monitor_puts (line);
+#endif
+
+  /* entries gdb never heard of went to range or watch stepping,
+     stepping over breakpoints, tracepoints and profiling */
+  strcpy (line, "monitor entries ");
+  buf = long2hex (stubStats.entries, line + strlen (line));
+  strcpy (buf, ", stops ");
+  buf = long2hex (stubStats.stops, buf + strlen (buf));
+  strcpy (buf, "\n");
+  monitor_puts (line);
+
+  for (i = 0; i <= NSTAT_TYPES; i++)
+    if (stubStats.byType[i])
+      {
+        line[0] = (i < NSTAT_TYPES) ? STAT_TYPES[i] : '*';
+        line[1] = ' ';
+        buf = word2hex (stubStats.byType[i], line + 2);
+        strcpy (buf, "\n");
+        monitor_puts (line);
+      }
+  return 0;
+}
+
+/* Count a packet from gdb by its command letter */
+static void
+stats_packet (char cmd)
+{
+  char *type = strchr (STAT_TYPES, cmd);
+
+  if (!cmd || !type)
+    stubStats.byType[NSTAT_TYPES]++;
+  else
+    stubStats.byType[type - STAT_TYPES]++;
 }
 
 /*
@@ -768,16 +2896,34 @@ gdb_handle_exception (int exceptionVector)
 {
   int sigval, stepping;
   int addr, length;
+  unsigned long laddr;
   char *ptr;
+  char type, insert;
+  char *conds;
+  char stepTrap, traceHit;
+  breakData *bp;
+  char *mem;
+
+  stubStats.entries++;
+
+  /* an NMI on rr's way out stops the inferior as any other */
+  if (exceptionVector == Z80_NMI_EXIT)
+    exceptionVector = Z80_NMI;
+
+#ifdef UART_RX_IRQ
+  /* the interrupt that brought the ^C turned the inferior's interrupts
+     off, they were on */
+  if (exceptionVector == Z80_UART_BREAK)
+    inferior_iff |= 0x04;
+#endif
 
-  /* reply to host that an exception has occurred */
-  sigval = computeSignal (exceptionVector);
-  remcomOutBuffer[0] = 'S';
-  remcomOutBuffer[1] = highhex(sigval);
-  remcomOutBuffer[2] = lowhex (sigval);
-  remcomOutBuffer[3] = 0;
-
-  putpacket (remcomOutBuffer);
+  /* a profiling NMI only takes a sample, breakpoints and steps are left
+     as they are for the inferior to carry on */
+  if (profiling && exceptionVector == Z80_NMI)
+    {
+      profile_sample ();
+      return;
+    }
 
   /*
    * Exception 0x08 means a RST 08 instruction (breakpoint) inserted in
@@ -790,33 +2936,103 @@ gdb_handle_exception (int exceptionVector)
     registers.pc -= 1;
 
   /*
-   * Do the thangs needed to undo
-   * any stepping we may have done!
+   * Take our breakpoints out, gdb should see the real code while we
+   * are stopped, and do the thangs needed to undo any stepping we may
+   * have done!  (the reverse order of the resume in 'c' and 's')
    */
+  stepTrap = (exceptionVector == Z80_RST08_VEC && stepped
+              && (char *) registers.pc == instrBuffer.memAddr);
+  remove_breakpoints ();
   undoSStep ();
 
+  bp = 0;
+  traceHit = 0;
+  if (exceptionVector == Z80_RST08_VEC)
+    {
+      bp = find_breakpoint ((char *) registers.pc);
+      traceHit = collect_trace ((char *) registers.pc);
+    }
+  breakHit = (bp != 0);
+
+  /* a breakpoint whose conditions are all false is not a stop */
+  if (breakHit && bp->condLen && !breakpoint_condition (bp))
+    breakHit = 0;
+
+  /* the inferior ran into one of those or a tracepoint: step past it
+     and carry on with the continue from there */
+  if (!stepTrap && !breakHit && (bp || traceHit))
+    {
+      stepOver = (bp != 0);
+      resume (0);
+      return;
+    }
+
+  watchHit = 0;
+  if (stepTrap && watchpoints_set ())
+    check_watchpoints ();
+
+  /* steps gdb didn't ask for go on quietly: range stepping until PC
+     leaves the range, continues with watchpoints until one triggers */
+  if (stepTrap && !breakHit && !watchHit)
+    {
+      if (stepOver)
+        {
+          stepOver = 0;
+          resume (0);
+          return;
+        }
+      if (rangeStepping
+          && (unsigned short) registers.pc >= rangeStart
+          && (unsigned short) registers.pc < rangeEnd)
+        {
+          resume (1);
+          return;
+        }
+      if (watchContinue)
+        {
+          resume (0);
+          return;
+        }
+    }
+  rangeStepping = 0;
+  stepOver = 0;
+
+  /* reply to host that an exception has occurred */
+  stubStats.stops++;
+  sigval = computeSignal (exceptionVector);
+  stop_reply (sigval);
+  putpacket (remcomOutBuffer);
+
   stepping = 0;
 
   while (1)
     {
       remcomOutBuffer[0] = 0;
       ptr = getpacket ();
+      stats_packet (*ptr);
 
       switch (*ptr++)
         {
         case '?':
-          remcomOutBuffer[0] = 'S';
-          remcomOutBuffer[1] = highhex (sigval);
-          remcomOutBuffer[2] = lowhex (sigval);
-          remcomOutBuffer[3] = 0;
+          stop_reply (sigval);
           break;
         case 'd':
           remote_debug = !(remote_debug);       /* toggle debug flag */
           break;
         case 'g':               /* return the value of the CPU registers */
-          mem2hex ((char *) registers, remcomOutBuffer, NUMREGBYTES);
+          if (traceFrame >= 0)
+            mem2hex (trace_frame (traceFrame)->regs, remcomOutBuffer,
+                     NUMREGBYTES);
+          else
+            mem2hex ((char *) registers, remcomOutBuffer, NUMREGBYTES);
           break;
         case 'G':               /* set the value of the CPU registers - return OK */
+          /* the selected trace frame is history, it can't be written */
+          if (traceFrame >= 0)
+            {
+              strcpy (remcomOutBuffer, "E01");
+              break;
+            }
           hex2mem (ptr, (char *) registers, NUMREGBYTES);
           strcpy (remcomOutBuffer, "OK");
           break;
@@ -825,12 +3041,27 @@ gdb_handle_exception (int exceptionVector)
         case 'm':
           dofault = 0;
           /* TRY, TO READ %x,%x.  IF SUCCEED, SET PTR = 0 */
-          if (hexToInt (&ptr, &addr))
+          if (hexToLong (&ptr, &laddr))
             if (*(ptr++) == ',')
               if (hexToInt (&ptr, &length))
                 {
                   ptr = 0;
-                  mem2hex ((char *) addr, remcomOutBuffer, length);
+                  /* reply with as much as fits in the buffer */
+                  if ((unsigned int) length > (BUFMAX - 1) / 2)
+                    length = (BUFMAX - 1) / 2;
+                  /* looking at a trace frame, only what it collected */
+                  if (traceFrame >= 0 && laddr > 0xffff)
+                    mem = 0;
+                  else if (traceFrame >= 0)
+                    mem = trace_memory ((char *) (unsigned int) laddr,
+                                        &length);
+                  else
+                    mem = mem_map (laddr, (unsigned int *) &length);
+                  if (mem)
+                    mem2hex (mem, remcomOutBuffer, length);
+                  else
+                    strcpy (remcomOutBuffer, "E01");
+                  mem_unmap ();
                 }
           if (ptr)
             strcpy (remcomOutBuffer, "E01");
@@ -839,15 +3070,49 @@ gdb_handle_exception (int exceptionVector)
 
           /* MAA..AA,LLLL: Write LLLL bytes at address AA.AA return OK */
         case 'M':
+          /* nor its memory */
+          if (traceFrame >= 0)
+            {
+              strcpy (remcomOutBuffer, "E01");
+              break;
+            }
           /* TRY, TO READ '%x,%x:'.  IF SUCCEED, SET PTR = 0 */
-          if (hexToInt (&ptr, &addr))
+          if (hexToLong (&ptr, &laddr))
             if (*(ptr++) == ',')
               if (hexToInt (&ptr, &length))
                 if (*(ptr++) == ':')
                   {
-                    hex2mem (ptr, (char *) addr, length);
+                    if (write_memory (laddr, ptr, length, 0))
+                      strcpy (remcomOutBuffer, "OK");
+                    else
+                      strcpy (remcomOutBuffer, "E03");
+                    ptr = 0;
+                  }
+          if (ptr)
+            strcpy (remcomOutBuffer, "E02");
+
+          break;
+
+          /* XAA..AA,LLLL: Write LLLL binary bytes at address AA.AA return OK */
+        case 'X':
+          /* nor its memory */
+          if (traceFrame >= 0)
+            {
+              strcpy (remcomOutBuffer, "E01");
+              break;
+            }
+          /* TRY, TO READ '%x,%x:'.  IF SUCCEED, SET PTR = 0 */
+          if (hexToLong (&ptr, &laddr))
+            if (*(ptr++) == ',')
+              if (hexToInt (&ptr, &length))
+                if (*(ptr++) == ':')
+                  {
+                    /* getpacket already undid the escaping */
+                    if (write_memory (laddr, ptr, length, 1))
+                      strcpy (remcomOutBuffer, "OK");
+                    else
+                      strcpy (remcomOutBuffer, "E03");
                     ptr = 0;
-                    strcpy (remcomOutBuffer, "OK");
                   }
           if (ptr)
             strcpy (remcomOutBuffer, "E02");
@@ -864,12 +3129,123 @@ gdb_handle_exception (int exceptionVector)
             if (hexToInt (&ptr, &addr))
               registers.pc = addr;
               //registers[R_PC] = addr;
-            if (stepping)
-              doSStep ();
+            resume (stepping);
           }
           return;
           break;
 
+        case 'v':
+          if (!strncmp ("Cont?", ptr, strlen ("Cont?")))
+            strcpy (remcomOutBuffer, "vCont;c;C;s;S;r");
+          else if (!strncmp ("Cont;", ptr, strlen ("Cont;")))
+            {
+              /* there is a single thread, so the first action is it */
+              ptr += strlen ("Cont;");
+              switch (*ptr++)
+                {
+                case 'r':
+                  /* rAA..AA,BB..BB  step while PC is in [AA..AA, BB..BB) */
+                  if (hexToInt (&ptr, &addr))
+                    if (*(ptr++) == ',')
+                      if (hexToInt (&ptr, &length))
+                        {
+                          rangeStart = addr;
+                          rangeEnd = length;
+                          rangeStepping = 1;
+                          ptr = 0;
+                        }
+                  if (ptr)
+                    break;
+                case 's':
+                case 'S':               /* the signal is ignored */
+                  stepping = 1;
+                case 'c':
+                case 'C':
+                  resume (stepping);
+                  return;
+                }
+              strcpy (remcomOutBuffer, "E01");
+            }
+          else if (!strncmp ("LZWrite:", ptr, strlen ("LZWrite:"))
+                   && traceFrame >= 0)
+            strcpy (remcomOutBuffer, "E01");    /* not into a trace frame */
+          else if (!strncmp ("LZWrite:", ptr, strlen ("LZWrite:")))
+            {
+              /* vLZWrite:AA..AA,LLLL,CCCCCCCC:BB..BB  unpack the LZ4
+                 block BB..BB (binary) to AA..AA, it must give LLLL
+                 bytes with CRC-32 CCCCCCCC */
+              char *end = remcomInBuffer + remcomInCount;
+              unsigned long crc;
+              unsigned int part;
+
+              ptr += strlen ("LZWrite:");
+              if (hexToLong (&ptr, &laddr))
+                if (*(ptr++) == ',')
+                  if (hexToInt (&ptr, &length) && length)
+                    if (*(ptr++) == ',')
+                      if (hexToLong (&ptr, &crc))
+                        if (*(ptr++) == ':' && ptr < end)
+                          {
+                            /* matches copy from the output, so it must
+                               all be in one piece, one bank */
+                            part = length;
+                            mem = mem_map (laddr, &part);
+                            if (!mem || part != (unsigned int) length)
+                              strcpy (remcomOutBuffer, "E01");
+                            else if (lz4_unpack (ptr, end - ptr, mem)
+                                     != mem + part)
+                              strcpy (remcomOutBuffer, "E03");
+                            else if (memcrc32 (mem, part) != crc)
+                              strcpy (remcomOutBuffer, "E02");
+                            else
+                              strcpy (remcomOutBuffer, "OK");
+                            mem_unmap ();
+                            ptr = 0;
+                          }
+              if (ptr)
+                strcpy (remcomOutBuffer, "E01");
+            }
+          break;
+
+          /* Z0,AA..AA,K  Insert a software breakpoint at AA..AA */
+          /* ZT,AA..AA,LL Insert a type T (2-4) watchpoint on LL bytes */
+          /* z0/zT        Remove them */
+        case 'Z':
+        case 'z':
+          insert = (ptr[-1] == 'Z');
+          type = *ptr++;
+          /* TRY, TO READ ',%x,%x'.  IF SUCCEED, SET PTR = 0 */
+          /* breakpoints and watchpoints below 0x10000 only */
+          if (*(ptr++) == ',')
+            if (hexToLong (&ptr, &laddr) && laddr <= 0xffff)
+              if (*(ptr++) == ',')
+                if (hexToInt (&ptr, &length))
+                  {
+                    addr = (unsigned int) laddr;
+                    conds = ptr;
+                    ptr = 0;
+                    strcpy (remcomOutBuffer, "OK");
+                    if (type == '0')
+                      {
+                        if (!insert)
+                          clear_breakpoint ((char *) addr);
+                        else if (set_breakpoint ((char *) addr, conds))
+                          strcpy (remcomOutBuffer, "E01");
+                      }
+                    else if (type >= '2' && type <= '4')
+                      {
+                        if (!insert)
+                          clear_watchpoint (type, (char *) addr, length);
+                        else if (set_watchpoint (type, (char *) addr, length))
+                          strcpy (remcomOutBuffer, "E01");
+                      }
+                    else
+                      remcomOutBuffer[0] = 0;   /* not supported */
+                  }
+          if (ptr)
+            strcpy (remcomOutBuffer, "E01");
+          break;
+
           /* kill the program */
         case 'k':               /* do nothing */
           break;
@@ -882,9 +3258,11 @@ gdb_handle_exception (int exceptionVector)
               if (!handle_monitor_command(ptr + strlen("Rcmd,")))
                 {
                   // monitor command was sucessful. 
-                  // handle_monitor_command wrote an Output response to the
-                  // command in remcomOutBuffer, so we send it now.
-                  putpacket(remcomOutBuffer);
+                  // handle_monitor_command may have written an Output
+                  // response to the command in remcomOutBuffer, so we
+                  // send it now.
+                  if (remcomOutBuffer[0])
+                    putpacket(remcomOutBuffer);
 
                   // then we set up another OK packet which will be
                   // sent as the final response packet.
@@ -893,6 +3271,169 @@ gdb_handle_exception (int exceptionVector)
               else
                 strcpy (remcomOutBuffer, "E01");
             }
+          else if (!strncmp ("CRC:", ptr, strlen ("CRC:")))
+            {
+              /* qCRC:AA..AA,LLLL  CRC-32 of LLLL bytes at AA..AA */
+              ptr += strlen ("CRC:");
+              if (hexToLong (&ptr, &laddr))
+                if (*(ptr++) == ',')
+                  if (hexToInt (&ptr, &length))
+                    {
+                      unsigned long crc;
+                      unsigned int part = length;
+
+                      /* in one bank, or below 0x10000 */
+                      mem = mem_map (laddr, &part);
+                      if (mem && part == (unsigned int) length)
+                        {
+                          crc = memcrc32 (mem, part);
+                          remcomOutBuffer[0] = 'C';
+                          word2hex (crc >> 16, remcomOutBuffer + 1);
+                          word2hex (crc, remcomOutBuffer + 5);
+                          ptr = 0;
+                        }
+                      mem_unmap ();
+                    }
+              if (ptr)
+                strcpy (remcomOutBuffer, "E01");
+            }
+          else if (!strncmp ("CRCBlocks:", ptr, strlen ("CRCBlocks:")))
+            {
+              /* qCRCBlocks:AA..AA,LLLL,BBBB  CRC-32 of each BBBB bytes */
+              int block;
+
+              ptr += strlen ("CRCBlocks:");
+              if (hexToLong (&ptr, &laddr))
+                if (*(ptr++) == ',')
+                  if (hexToInt (&ptr, &length))
+                    if (*(ptr++) == ',')
+                      if (hexToInt (&ptr, &block) && block)
+                        {
+                          unsigned int part = length;
+
+                          /* up to the end of the bank, in whole blocks:
+                             the client asks again for the rest */
+                          mem = mem_map (laddr, &part);
+                          if (part < (unsigned int) length)
+                            part -= part % (unsigned int) block;
+                          if (mem && (part || !length))
+                            {
+                              crc_blocks (mem, part, block);
+                              ptr = 0;
+                            }
+                          mem_unmap ();
+                        }
+              if (ptr)
+                strcpy (remcomOutBuffer, "E01");
+            }
+          else if (!strncmp ("Search:memory:", ptr, strlen ("Search:memory:")))
+            {
+              /* qSearch:memory:AA..AA;LLLL;PP..PP  PP..PP is binary */
+              ptr += strlen ("Search:memory:");
+              if (hexToLong (&ptr, &laddr))
+                if (*(ptr++) == ';')
+                  if (hexToInt (&ptr, &length))
+                    if (*(ptr++) == ';')
+                      if (search_memory (laddr, length, ptr,
+                                         remcomInBuffer + remcomInCount - ptr))
+                        ptr = 0;
+              if (ptr)
+                strcpy (remcomOutBuffer, "E01");
+            }
+#ifdef BANKED_MEMORY
+          else if (!strncmp ("Xfer:memory-map:read::",
+                             ptr, strlen ("Xfer:memory-map:read::")))
+            {
+              /* qXfer:memory-map:read::OFFSET,LENGTH  a window of the
+                 document, m if more follows, l for the last part */
+              ptr += strlen ("Xfer:memory-map:read::");
+              if (hexToInt (&ptr, &addr))
+                if (*(ptr++) == ',')
+                  if (hexToInt (&ptr, &length))
+                    {
+                      unsigned int left;
+
+                      memory_map ();
+                      left = strlen (memoryMap);
+                      left = (unsigned int) addr < left ? left - addr : 0;
+                      if ((unsigned int) length > BUFMAX - 2)
+                        length = BUFMAX - 2;
+                      remcomOutBuffer[0] = 'm';
+                      if ((unsigned int) length >= left)
+                        {
+                          length = left;
+                          remcomOutBuffer[0] = 'l';
+                        }
+                      memcpy (remcomOutBuffer + 1, memoryMap + addr, length);
+                      remcomOutBuffer[length + 1] = 0;
+                      ptr = 0;
+                    }
+              if (ptr)
+                strcpy (remcomOutBuffer, "E01");
+            }
+#endif
+          else if (!strncmp ("TStatus", ptr, strlen ("TStatus")))
+            trace_status (remcomOutBuffer);
+          else if (!strncmp ("Supported", ptr, strlen ("Supported")))
+            {
+              /* gdb (re)connected, it starts with acks on */
+              noack_mode = 0;
+
+              /* report the largest packet we can take */
+              strcpy (remcomOutBuffer, "PacketSize=");
+              word2hex (BUFMAX - 1, remcomOutBuffer + strlen ("PacketSize="));
+              strcat (remcomOutBuffer, ";QStartNoAckMode+;swbreak+");
+              strcat (remcomOutBuffer, ";ConditionalBreakpoints+");
+#ifdef BANKED_MEMORY
+              strcat (remcomOutBuffer, ";qXfer:memory-map:read+");
+#endif
+            }
+          break;
+
+        case 'Q':
+          if (!strncmp ("StartNoAckMode", ptr, strlen ("StartNoAckMode")))
+            {
+              /* this OK still gets acked, acks stop right after it */
+              putpacket ("OK");
+              noack_mode = 1;
+              continue;
+            }
+          else if (!strncmp ("TDP:", ptr, strlen ("TDP:")))
+            {
+              if (trace_define (ptr + strlen ("TDP:")))
+                strcpy (remcomOutBuffer, "E01");
+              else
+                strcpy (remcomOutBuffer, "OK");
+            }
+          else if (!strncmp ("Tinit", ptr, strlen ("Tinit")))
+            {
+              memset (traceTable, 0, sizeof (traceTable));
+              tracing = 0;
+              traceStop = TRACE_NOTRUN;
+              traceUsed = traceFrames = 0;
+              traceFrame = -1;
+              strcpy (remcomOutBuffer, "OK");
+            }
+          else if (!strncmp ("TStart", ptr, strlen ("TStart")))
+            {
+              trace_start ();
+              strcpy (remcomOutBuffer, "OK");
+            }
+          else if (!strncmp ("TStop", ptr, strlen ("TStop")))
+            {
+              if (tracing)
+                traceStop = TRACE_STOPPED;
+              tracing = 0;
+              strcpy (remcomOutBuffer, "OK");
+            }
+          else if (!strncmp ("TFrame:", ptr, strlen ("TFrame:")))
+            {
+              if (trace_select (ptr + strlen ("TFrame:")))
+                strcpy (remcomOutBuffer, "E01");
+            }
+          else if (!strncmp ("Tro", ptr, strlen ("Tro")))
+            /* read-only sections are read live, nothing to keep */
+            strcpy (remcomOutBuffer, "OK");
           break;
         }                       /* switch */
 
@@ -905,6 +3446,7 @@ gdb_handle_exception (int exceptionVector)
 static int ingdbmode;
 void handle_exception(int exceptionVector)
 {
+  init_serial ();
   gdb_handle_exception (exceptionVector);
 }
 
@@ -983,6 +3525,16 @@ sr() __naked
      push  af
      ld    a, i
      ld    (#_registers + R_I), a    ; yes, A
+#ifdef UART_RX_IRQ
+     push  af                        ;; ld a,i copied IFF2 to P/V, keep it
+     pop   hl                        ;; so rr can give the inferior back
+     ld    a, (#_intcause)           ;; its interrupt state.  Not when rr
+     cp    #Z80_NMI_EXIT             ;; was doing that: it had IFF2 off
+     jr    z, 0001$                  ;; and inferior_iff is still right
+     ld    a, l
+     ld    (#_inferior_iff), a
+0001$:
+#endif
      ld    a, r
      ld    (#_registers + R_R), a    ; yes, A
      pop   af
@@ -1023,6 +3575,32 @@ sr() __naked
  void rr() __naked
  {
    __asm
+     ld    a, (#_nmi_pending)              ;; an NMI came in meanwhile, it
+     or    a                               ;; stops the inferior before it
+     jr    z, 0002$                        ;; runs again
+     xor   a
+     ld    (#_nmi_pending), a
+     ld    hl, #Z80_NMI
+     ld    (#_intcause), hl
+     push  hl
+     call  _handle_exception
+     pop   af
+     jp    _rr
+0002$:
+
+#ifdef UART_RX_IRQ
+     di                                    ;; the monitor ran with interrupts on
+     ld    hl, #_rr_ei                     ;; and the inferior gets them back
+     ld    a, (#_inferior_iff)             ;; if its IFF2, P/V, was on
+     and   #0x04
+     jr    nz, 0003$
+#endif
+     ld    hl, #_rr_di
+0003$:
+     ld    (#_rr_tail), hl
+     ld    a, (#_nmi_pending)              ;; one latched before rr_tail was
+     or    a                               ;; set would go unseen, from here
+     jp    nz, _rr                         ;; on nmi_entry points it at _rr_nmi
      ld    a, (#_registers + R_A) ;; restore AF
      ld    b, a
      ld    a, (#_registers + R_F)
@@ -1074,12 +3652,104 @@ sr() __naked
      ;; put the (new?) PC back in the stack as the return address
      ld    hl, (#_registers + R_PC)
      ex    (sp), hl
+
+     ld    hl, #0                          ;; out of the monitor: uart_isr
+     ld    (#_intcause), hl                ;; and nmi_entry stop the inferior
+_rr_exit::                                 ;; again, nmi_entry knows what follows:
+                                           ;; all but hl is the inferior's.  An
+     ld    hl, (#_rr_tail)                 ;; NMI latched until then has turned
+     jp    (hl)                            ;; rr_tail to _rr_nmi, no flags needed
+#ifdef UART_RX_IRQ
+_rr_ei::
+     ld    hl, (#_registers + R_HL)
+     out   (NMI_FF_CLR), a
+     ei
+     retn
+#endif
+_rr_di::
      ld    hl, (#_registers + R_HL)
 
      ;; we might have interrupted the inferior with a NMI,
      ;; so we use retn just in case.
      out (NMI_FF_CLR), a ;; clear the external NMI FF
      retn
+
+_rr_nmi::                                  ;; the latched NMI stops the inferior
+     ld    hl, #0                          ;; here, as one on the way out would
+     ld    (#_nmi_pending), hl
+     ld    hl, #Z80_NMI_EXIT               ;; the push below is not the state
+     ld    (#_intcause), hl                ;; nmi_entry expects, from here an
+     ld    hl, (#_registers + R_HL)        ;; NMI is latched for the next rr
+     push  hl
+     ld    hl, #Z80_NMI_EXIT
+     jp    _sr
+_rr_end::
+  __endasm;
+}
+
+/* NMI entry from crt0.  The NMI can't be masked, and going through sr
+   while the monitor runs would overwrite registers and the monitor
+   stack, so then it is only latched, in nmi_pending and rr_tail, and
+   rr takes it before resuming the inferior: at its top, or at its
+   exit for one that came in after its last look.  Between _rr_exit and _rr_end the
+   inferior has all its registers back but hl, with its pc on top of
+   its stack: an NMI there stops it as if it had come a moment later,
+   Z80_NMI_EXIT telling sr that IFF2 is rr's, not the inferior's. */
+void
+nmi_entry (void) __naked
+{
+  __asm
+    push  af
+    push  hl
+    ld    hl, (#_intcause)
+    ld    a, h
+    or    l
+    jr    nz, 0001$                 ;; the monitor is running
+
+    push  de
+    ld    hl, #6
+    add   hl, sp
+    ld    e, (hl)                   ;; de = the interrupted pc
+    inc   hl
+    ld    d, (hl)
+    ex    de, hl
+    ld    de, #_rr_exit
+    or    a
+    sbc   hl, de
+    ld    de, #_rr_end - _rr_exit
+    or    a
+    sbc   hl, de                    ;; carry if _rr_exit <= pc < _rr_end
+    pop   de
+    jr    c, 0002$
+
+    pop   hl
+    pop   af
+    push  hl                        ;; into sr as the RST vectors do
+    ld    hl, #Z80_NMI
+    jp    _sr
+
+0001$:
+    ld    a, #1
+    ld    (#_nmi_pending), a
+    ld    hl, #_rr_nmi              ;; for rr's exit, past its last check
+    ld    (#_rr_tail), hl
+    out   (NMI_FF_CLR), a           ;; let the next one in
+    pop   hl
+    pop   af
+    retn
+
+0002$:
+    out   (NMI_FF_CLR), a
+    xor   a                         ;; this stop answers a latched one too
+    ld    (#_nmi_pending), a
+    pop   hl
+    pop   af
+    inc   sp                        ;; drop the return into rr
+    inc   sp
+    ld    hl, (#_registers + R_HL)
+    push  hl
+    ld    hl, #Z80_NMI_EXIT
+    jp    _sr
   __endasm;
 }
 
@@ -1089,17 +3759,131 @@ handleError (char theSSR);
 void 
 init_serial (void)
 {
+#ifdef UART_RX_IRQ
+  static char ring_ready;
+
+  /* the ring once, on the first stop: later ones may find gdb's next
+     packet already in it */
+  if (!ring_ready)
+    {
+      rx_head = rx_tail = 0;
+      ring_ready = 1;
+    }
+
+  /* the monitor takes characters through uart_isr, rr turns
+     interrupts back off before resuming the inferior */
+  __asm
+    im    1
+    ei
+  __endasm;
+#endif
+}
+
+/* RST 38 handler.  With UART_RX_IRQ, a received character is queued in
+   rxbuf (and dropped if the ring is full); anything else is passed on
+   to the inferior's handler at USER_INT_VEC, or dropped while the
+   monitor runs, the inferior being stopped.  A ^C while the inferior
+   runs is gdb's interrupt request: it stops the inferior right there,
+   through sr as Z80_UART_BREAK.  Not while the inferior is on its way
+   into sr from a crt0 vector, the stop that follows does for it. */
+void
+uart_isr (void) __naked
+{
+  __asm
+#ifdef UART_RX_IRQ
+    push  af
+    push  bc
+    push  hl
+
+    in    a, (UART_DATA)            ;; as getDebugChar polls: the read
+    ld    c, a                      ;; sets UART_RX_VALID, which says
+    in    a, (UART_RX_VALID)        ;; whether it got a character
+    and   #UART_RX_VALID_MASK
+    jr    z, 0002$                  ;; not the UART
+
+    ld    a, c
+    cp    #0x03
+    jr    nz, 0004$
+    ld    hl, (#_intcause)
+    ld    a, h
+    or    l
+    jr    nz, 0004$                 ;; the monitor is running
+    ld    hl, #7
+    add   hl, sp
+    ld    a, (hl)                   ;; msb of the interrupted pc
+    or    a
+    jr    z, 0004$                  ;; in the vectors, about to enter sr
+
+    pop   hl
+    pop   bc
+    pop   af
+    push  hl                        ;; sr wants hl and the cause as RST does
+    ld    hl, #Z80_UART_BREAK
+    jp    _sr
+
+0004$:
+    ld    a, (#_rx_head)
+    and   #RXBUF_MASK
+    ld    b, a
+    inc   a
+    and   #RXBUF_MASK
+    ld    hl, #_rx_tail
+    cp    (hl)
+    jr    z, 0003$                  ;; ring full, drop it
+
+    ld    hl, #_rxbuf               ;; rxbuf[rx_head] = c
+    ld    a, b
+    add   a, l
+    ld    l, a
+    adc   a, h
+    sub   l
+    ld    h, a
+    ld    (hl), c
+
+    ld    a, b                      ;; publish it
+    inc   a
+    and   #RXBUF_MASK
+    ld    (#_rx_head), a
+    jr    0001$
+
+0003$:
+    ld    hl, (#_rx_overruns)       ;; count the dropped character
+    inc   hl
+    ld    (#_rx_overruns), hl
+
+0001$:
+    pop   hl
+    pop   bc
+    pop   af
+    ei
+    reti
+
+0002$:
+    ld    hl, (#_intcause)
+    ld    a, h
+    or    l
+    jr    nz, 0001$                 ;; the monitor is running, drop it
+    pop   hl
+    pop   bc
+    pop   af
+#endif
+    jp    USER_INT_VEC
+  __endasm;
 }
 
 int
 getDebugCharReady (void)
 {
+#ifdef UART_RX_IRQ
+  return (rx_head != rx_tail);
+#else
 #ifdef TARGET_Z80
   __asm
 
   __endasm;
 #endif
   return 1;
+#endif
 }
 
 char 
@@ -1120,6 +3904,13 @@ getDebugChar (void)
 #endif
 
 #ifdef TARGET_Z80
+#ifdef UART_RX_IRQ
+  /* uart_isr fills the ring, we only drain it */
+  while (rx_head == rx_tail)
+    ;
+  read_ch = rxbuf[rx_tail & RXBUF_MASK];
+  rx_tail = (rx_tail + 1) & RXBUF_MASK;
+#else
 
   __asm
 0001$: 
@@ -1131,6 +3922,7 @@ getDebugChar (void)
     jr z, 0001$
   __endasm;
 
+#endif
 #endif
 
   return read_ch;
@@ -1170,6 +3962,45 @@ putDebugChar (char ch)
  return;
 }
 
+/* Send len characters from buf in one burst.  Like putDebugChar, this
+   doesn't wait on the transmitter (putDebugCharReady is always true
+   on our targets), so otir can push up to 256 bytes per go. */
+void
+putDebugBuf (char *buf, int len) __naked
+{
+  __asm
+    push ix
+    ld   ix, #0
+    add  ix, sp
+
+    ld   l, 4 (ix)          ;; hl = buf
+    ld   h, 5 (ix)
+    ld   e, 6 (ix)          ;; de = len
+    ld   d, 7 (ix)
+    ld   c, #UART_DATA
+
+0001$:
+    ld   a, d               ;; whole 256 byte blocks first
+    or   a
+    jr   z, 0002$
+    ld   b, #0
+    otir
+    dec  d
+    jr   0001$
+
+0002$:
+    ld   a, e               ;; then the rest
+    or   a
+    jr   z, 0003$
+    ld   b, a
+    otir
+
+0003$:
+    pop  ix
+    ret
+  __endasm;
+}
+
 void 
 handleError (char theSSR)
 {
@@ -1217,8 +4048,7 @@ pref_ind (void *pc, const struct tab_elt *inst)
   struct tab_elt *p;
   char *cpc = (char *)pc;
 
-  for (p = opc_ind; p->val != (cpc[1] & p->mask); ++p)
-    ;
+  p = &opc_ind[opc_ind_idx[(unsigned char) cpc[1]]];
   return (cpc + 
           1   + // FD or DD  prefix
           p->inst_len);
@@ -1237,8 +4067,7 @@ pref_ed (void *pc, const struct tab_elt *inst)
   struct tab_elt *p;
   char *cpc = (char *)pc;
 
-  for (p = opc_ed; p->val != (cpc[1] & p->mask); ++p)
-    ;
+  p = &opc_ed[opc_ed_idx[(unsigned char) cpc[1]]];
   return p->fp(cpc, p);
 }
 // -------------------- 
@@ -1406,13 +4235,152 @@ pe_ret_cc (void *pc, const struct tab_elt *inst)
     }
 }
 
+//---------- MEMORY OPERANDS, FOR WATCHPOINTS ----------
+
+/* what an instruction does with its (hl) or (ix+d) operand, the
+   encoding is the same with or without the DD/FD prefix */
+static char
+ind_operand (unsigned char op)
+{
+  if (op == 0x34 || op == 0x35)         // inc/dec (hl)
+    return MEM_RD | MEM_WR;
+  if (op == 0x36)                       // ld (hl),n
+    return MEM_WR;
+  if (op == 0x76)                       // halt
+    return 0;
+  if ((op & 0xF8) == 0x70)              // ld (hl),r
+    return MEM_WR;
+  if ((op & 0xC7) == 0x46)              // ld r,(hl)
+    return MEM_RD;
+  if ((op & 0xC7) == 0x86)              // add/adc/sub/sbc/and/xor/or/cp (hl)
+    return MEM_RD;
+  return 0;
+}
+
+/* Find the data memory the instruction at pc accesses, leaving it in
+   *addr and *len.  Return MEM_RD and/or MEM_WR, or 0 when there is
+   none we know of (stack pushes and pops are not counted).  A block
+   move adds MEM_MOVE with its destination in accessDest. */
+static char
+mem_operand (char *pc, char **addr, unsigned long *len)
+{
+  unsigned char *p = (unsigned char *) pc;
+  char *ind;
+  unsigned int n;
+
+  *len = 1;
+
+  switch (p[0])
+    {
+    case 0x02:                          // ld (bc),a
+      *addr = (char *) registers.bc;
+      return MEM_WR;
+    case 0x0A:                          // ld a,(bc)
+      *addr = (char *) registers.bc;
+      return MEM_RD;
+    case 0x12:                          // ld (de),a
+      *addr = (char *) registers.de;
+      return MEM_WR;
+    case 0x1A:                          // ld a,(de)
+      *addr = (char *) registers.de;
+      return MEM_RD;
+    case 0x22:                          // ld (nn),hl
+      *addr = *(char **) (p + 1);
+      *len = 2;
+      return MEM_WR;
+    case 0x2A:                          // ld hl,(nn)
+      *addr = *(char **) (p + 1);
+      *len = 2;
+      return MEM_RD;
+    case 0x32:                          // ld (nn),a
+      *addr = *(char **) (p + 1);
+      return MEM_WR;
+    case 0x3A:                          // ld a,(nn)
+      *addr = *(char **) (p + 1);
+      return MEM_RD;
+    case 0xE3:                          // ex (sp),hl
+      *addr = (char *) registers.sp;
+      *len = 2;
+      return MEM_RD | MEM_WR;
+
+    case 0xCB:
+      *addr = (char *) registers.hl;
+      if ((p[1] & 0x07) != 6)
+        return 0;
+      return ((p[1] & 0xC0) == 0x40) ? MEM_RD : MEM_RD | MEM_WR; // bit or rest
+
+    case 0xED:
+      if ((p[1] & 0xC7) == 0x43)        // ld (nn),rr / ld rr,(nn)
+        {
+          *addr = *(char **) (p + 2);
+          *len = 2;
+          return (p[1] & 0x08) ? MEM_RD : MEM_WR;
+        }
+      *addr = (char *) registers.hl;
+      if (p[1] == 0x67 || p[1] == 0x6F) // rrd, rld
+        return MEM_RD | MEM_WR;
+      if ((p[1] & 0xE4) == 0xA0)        // ldi, cpi, ini, outi and friends
+        {
+          if (p[1] & 0x10)              // repeating, the whole block
+            {
+              /* BC bytes, B for inir and the I/O ones (C is the port);
+                 a count of 0 is 65536 or 256 */
+              n = (unsigned int) registers.bc >> 8;
+              if (p[1] & 0x02)
+                *len = n ? n : 256;
+              else
+                *len = registers.bc ? (unsigned int) registers.bc : 0x10000UL;
+            }
+          accessDest = (char *) registers.de;
+          if (*len == 0x10000UL)        // all of memory, wherever it starts
+            *addr = accessDest = 0;
+          else if (p[1] & 0x08)         // decrementing
+            {
+              *addr -= (unsigned int) *len - 1;
+              accessDest -= (unsigned int) *len - 1;
+            }
+          if ((p[1] & 0x03) == 0)       // ldi and friends write (de) too
+            return MEM_RD | MEM_MOVE;
+          return ((p[1] & 0x03) == 2) ? MEM_WR : MEM_RD;
+        }
+      return 0;
+
+    case 0xDD:
+    case 0xFD:
+      ind = (char *) ((p[0] == 0xDD) ? registers.ix : registers.iy);
+      switch (p[1])
+        {
+        case 0x22:                      // ld (nn),ix
+          *addr = *(char **) (p + 2);
+          *len = 2;
+          return MEM_WR;
+        case 0x2A:                      // ld ix,(nn)
+          *addr = *(char **) (p + 2);
+          *len = 2;
+          return MEM_RD;
+        case 0xE3:                      // ex (sp),ix
+          *addr = (char *) registers.sp;
+          *len = 2;
+          return MEM_RD | MEM_WR;
+        case 0xCB:                      // DD CB d op
+          *addr = ind + (signed char) p[2];
+          return ((p[3] & 0xC0) == 0x40) ? MEM_RD : MEM_RD | MEM_WR;
+        }
+      *addr = ind + (signed char) p[2];
+      return ind_operand (p[1]);
+    }
+
+  *addr = (char *) registers.hl;
+  return ind_operand (p[0]);
+}
+
 int
 handle_monitor_command(char *qRcmd_payload)
 {
   /* build the command string from the qRcmd message payload */
   // char payload_str[BUFMAX];
   char *cmdstr = payload_str;
-  hex2mem(qRcmd_payload, payload_str, BUFMAX);
+  *hex2mem(qRcmd_payload, payload_str, strlen(qRcmd_payload) / 2) = '\0';
   
   
   /* 
@@ -1472,6 +4440,24 @@ handle_monitor_command(char *qRcmd_payload)
         }
     } // end of OUT command
 
+  if (!strncmp("profile ", cmdstr, strlen("profile ")))
+    {
+      cmdstr += strlen("profile ");
+      while (*cmdstr == ' ') cmdstr++; // ignore extra whitespace
+
+      if (!profile_command(cmdstr))
+        return 0;
+    } // end of PROFILE command
+
+  if (!strncmp("stats", cmdstr, strlen("stats")))
+    {
+      cmdstr += strlen("stats");
+      while (*cmdstr == ' ') cmdstr++; // ignore extra whitespace
+
+      if (!stats_command(cmdstr))
+        return 0;
+    } // end of STATS command
+
 
  error:  
   // strcpy (remcomOutBuffer, "E01");